@@ -0,0 +1,246 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Relaxed entry time updates, used with --relatime.
+ *
+ * Access times are only written when they're older than the interval, so
+ * most accesses only read them. Modification and change times go to a
+ * buffer owned by the calling thread, a small table indexed by entry.
+ * Buffered times are folded into the entry when it's stat'ed, when their
+ * slot is needed for another entry and when the thread exits.
+ *
+ * Slots are only written by their thread. Readers copy them under a
+ * sequence counter and retry if the owner was writing meanwhile. Folding
+ * keeps the latest time, so a slot may be folded more than once.
+ */
+
+#include <etimes.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <hurd/fshelp.h>
+
+#include <pcifs.h>
+
+/* Slots per thread, a power of two */
+#define ETIMES_SLOTS 64
+
+struct etimes_slot
+{
+  /* Odd while the owner writes the slot */
+  unsigned seq;
+
+  /* Entry number plus one, zero for free slots */
+  uint32_t idx;
+
+  /* TOUCH_MTIME and TOUCH_CTIME bits, and their time */
+  int what;
+  struct timespec ts;
+};
+
+/* Buffer of a thread */
+struct etimes_buf
+{
+  struct etimes_buf *next, *prev;
+  struct etimes_slot slots[ETIMES_SLOTS];
+};
+
+/* Protects the list of buffers and folding into the entries */
+static pthread_mutex_t etimes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct etimes_buf *etimes_bufs;
+
+static pthread_key_t etimes_key;
+static pthread_once_t etimes_once = PTHREAD_ONCE_INIT;
+
+static void
+etimes_now (struct timespec *ts)
+{
+  struct timeval tv;
+
+  maptime_read (pcifs_maptime, &tv);
+  ts->tv_sec = tv.tv_sec;
+  ts->tv_nsec = tv.tv_usec * 1000;
+}
+
+static int
+timespec_before (struct timespec *a, struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec
+    || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Fold a buffered time into `e'. Called with etimes_lock held. */
+static void
+etimes_apply (struct pcifs_dirent *e, int what, struct timespec *ts)
+{
+  if ((what & TOUCH_MTIME) && timespec_before (&e->cold->mtime, ts))
+    e->cold->mtime = *ts;
+  if ((what & TOUCH_CTIME) && timespec_before (&e->cold->ctime, ts))
+    e->cold->ctime = *ts;
+}
+
+/* Copy a slot owned by another thread */
+static void
+etimes_slot_read (struct etimes_slot *slot, struct etimes_slot *copy)
+{
+  unsigned seq;
+
+  do
+    {
+      seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+      *copy = *slot;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1) || seq != __atomic_load_n (&slot->seq, __ATOMIC_RELAXED));
+}
+
+/* Fold all slots of `buf' and free it, on thread exit */
+static void
+etimes_buf_destroy (void *arg)
+{
+  struct etimes_buf *buf = arg;
+  struct etimes_slot *slot;
+  int i;
+
+  pthread_mutex_lock (&etimes_lock);
+  for (i = 0, slot = buf->slots; i < ETIMES_SLOTS; i++, slot++)
+    if (slot->idx)
+      etimes_apply (&fs->entries[slot->idx - 1], slot->what, &slot->ts);
+
+  if (buf->prev)
+    buf->prev->next = buf->next;
+  else
+    etimes_bufs = buf->next;
+  if (buf->next)
+    buf->next->prev = buf->prev;
+  pthread_mutex_unlock (&etimes_lock);
+
+  free (buf);
+}
+
+static void
+etimes_init (void)
+{
+  pthread_key_create (&etimes_key, etimes_buf_destroy);
+}
+
+/* Buffer of the calling thread, created on first use */
+static struct etimes_buf *
+etimes_buf_get (void)
+{
+  struct etimes_buf *buf;
+
+  pthread_once (&etimes_once, etimes_init);
+
+  buf = pthread_getspecific (etimes_key);
+  if (buf)
+    return buf;
+
+  /* Keep buffers of different threads in different cache lines */
+  if (posix_memalign ((void **) &buf, 64, sizeof (struct etimes_buf)))
+    return 0;
+  memset (buf, 0, sizeof (struct etimes_buf));
+
+  pthread_mutex_lock (&etimes_lock);
+  buf->next = etimes_bufs;
+  if (buf->next)
+    buf->next->prev = buf;
+  etimes_bufs = buf;
+  pthread_mutex_unlock (&etimes_lock);
+
+  pthread_setspecific (etimes_key, buf);
+
+  return buf;
+}
+
+/* Update the times of `e' in relaxed mode */
+void
+etimes_touch (struct pcifs_dirent *e, int what)
+{
+  struct etimes_buf *buf;
+  struct etimes_slot *slot;
+  struct timespec now;
+  uint32_t idx;
+
+  etimes_now (&now);
+
+  if ((what & TOUCH_ATIME)
+      && now.tv_sec - e->cold->atime.tv_sec >= (time_t) fs->params.relatime)
+    e->cold->atime = now;
+
+  what &= TOUCH_MTIME | TOUCH_CTIME;
+  if (!what)
+    return;
+
+  buf = etimes_buf_get ();
+  if (!buf)
+    {
+      /* No buffer, fold right away */
+      pthread_mutex_lock (&etimes_lock);
+      etimes_apply (e, what, &now);
+      pthread_mutex_unlock (&etimes_lock);
+      return;
+    }
+
+  idx = e - fs->entries + 1;
+  slot = &buf->slots[idx & (ETIMES_SLOTS - 1)];
+  if (slot->idx && slot->idx != idx)
+    {
+      /* Make room */
+      pthread_mutex_lock (&etimes_lock);
+      etimes_apply (&fs->entries[slot->idx - 1], slot->what, &slot->ts);
+      pthread_mutex_unlock (&etimes_lock);
+    }
+
+  __atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  if (slot->idx != idx)
+    slot->what = 0;
+  slot->idx = idx;
+  slot->what |= what;
+  slot->ts = now;
+  __atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Fold the times buffered by all threads for `e' */
+void
+etimes_fold (struct pcifs_dirent *e)
+{
+  struct etimes_buf *buf;
+  struct etimes_slot copy;
+  uint32_t idx;
+
+  if (!__atomic_load_n (&etimes_bufs, __ATOMIC_RELAXED))
+    return;
+
+  idx = e - fs->entries + 1;
+
+  pthread_mutex_lock (&etimes_lock);
+  for (buf = etimes_bufs; buf; buf = buf->next)
+    {
+      etimes_slot_read (&buf->slots[idx & (ETIMES_SLOTS - 1)], &copy);
+      if (copy.idx == idx)
+	etimes_apply (e, copy.what, &copy.ts);
+    }
+  pthread_mutex_unlock (&etimes_lock);
+}
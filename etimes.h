@@ -0,0 +1,30 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Header for relaxed entry time updates */
+
+#ifndef ETIMES_H
+#define ETIMES_H
+
+struct pcifs_dirent;
+
+void etimes_touch (struct pcifs_dirent *e, int what);
+void etimes_fold (struct pcifs_dirent *e);
+
+#endif /* ETIMES_H */
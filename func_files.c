@@ -26,8 +26,15 @@
 #include <func_files.h>
 
 #include <assert.h>
+#include <stdio.h>
 #include <sys/io.h>
 
+#include <pci_map.h>
+#include <mmio.h>
+#include <pci_index.h>
+#include <ncache.h>
+#include <npool.h>
+
 /* Read or write a block of data from/to the configuration space */
 static error_t
 config_block_op (struct pci_device *dev, off_t offset, size_t * len,
@@ -74,12 +81,144 @@ config_block_op (struct pci_device *dev, off_t offset, size_t * len,
   return 0;
 }
 
+/* Class of PCI-to-PCI bridges, and the range of their window registers */
+#define PCI_CLASS_BRIDGE_PCI	0x0604
+#define PCI_WINDOWS_START	0x1C
+#define PCI_WINDOWS_SIZE	0x18
+
+/* Whether [`offset', `offset' + `len') overlaps the register at `reg' */
+#define CONFIG_WRITE_HITS(offset, len, reg, size) \
+  ((offset) < (reg) + (size) && (offset) + (len) > (reg))
+
+/* Address bits of a BAR and of a ROM BAR */
+#define PCI_BAR_ADDR_MASK	0xFFFFFFF0
+#define PCI_XROMBAR_ADDR_MASK	0xFFFFF800
+
+/*
+ * Whether the bytes of `data', written at `offset', set all the `mask' bits
+ * they cover in the dword at `reg'. That's how BARs are sized.
+ */
+static int
+config_write_ones (off_t offset, size_t len, const void *data, off_t reg,
+		   uint32_t mask)
+{
+  const uint8_t *bytes = data;
+  uint32_t val = 0, written = 0;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    if (reg + i >= offset && reg + i < offset + len)
+      {
+	val |= (uint32_t) bytes[reg + i - offset] << (8 * i);
+	written |= (uint32_t) 0xFF << (8 * i);
+      }
+
+  mask &= written;
+  return mask && (val & mask) == mask;
+}
+
+/*
+ * Track a write of `data' to the configuration space of the function at
+ * `dir'.
+ *
+ * Writes to the BARs or the ROM BAR may move a decoder, so the cached base
+ * addresses are read again. Sizes are fixed by the hardware and nothing is
+ * probed. A write of all-ones is a client sizing the BAR and is ignored, the
+ * base is read once the client restores it. The same goes for bridge windows.
+ * The address index is only rebuilt if something actually moved.
+ *
+ * Must be called with `pci_conf_lock' held.
+ */
+error_t
+config_write_snoop (struct pcifs_dirent * dir, off_t offset, size_t len,
+		    const void *data)
+{
+  error_t err;
+  struct pci_device *dev;
+  struct pci_window io_window, mem_window, pref_window;
+  pciaddr_t base, rom_base;
+  off_t reg;
+  int i, j, nbars, moved, rom, windows;
+
+  dev = dir->device;
+
+  /* This should never happen */
+  assert_backtrace (dev != 0);
+
+  moved = 0;
+  for (i = 0; i < 6; i++)
+    {
+      if (dev->regions[i].size == 0)
+	continue;
+
+      /* A 64-bit region spans two BARs, both must be settled */
+      reg = PCI_BAR_ADDR_0 + 0x4 * i;
+      nbars = dev->regions[i].is_64 ? 2 : 1;
+      if (!CONFIG_WRITE_HITS (offset, len, reg, 4 * nbars))
+	continue;
+      for (j = 0; j < nbars; j++)
+	if (config_write_ones (offset, len, data, reg + 4 * j,
+			       PCI_BAR_ADDR_MASK))
+	  break;
+      if (j < nbars)
+	continue;
+
+      base = dev->regions[i].base_addr;
+      err = pci_sys->device_refresh (dev, i, 0);
+      if (err)
+	return err;
+      if (dev->regions[i].base_addr != base)
+	moved = 1;
+    }
+
+  rom = 0;
+  if (CONFIG_WRITE_HITS (offset, len, PCI_XROMBAR_ADDR_00, 4))
+    rom = !config_write_ones (offset, len, data, PCI_XROMBAR_ADDR_00,
+			      PCI_XROMBAR_ADDR_MASK);
+  else if (CONFIG_WRITE_HITS (offset, len, PCI_XROMBAR_ADDR_01, 4))
+    rom = !config_write_ones (offset, len, data, PCI_XROMBAR_ADDR_01,
+			      PCI_XROMBAR_ADDR_MASK);
+  if (rom)
+    {
+      rom_base = dev->rom_base;
+      err = pci_sys->device_refresh (dev, -1, 1);
+      if (err)
+	return err;
+      if (dev->rom_base != rom_base)
+	moved = 1;
+    }
+
+  windows = (dev->device_class >> 8) == PCI_CLASS_BRIDGE_PCI
+    && CONFIG_WRITE_HITS (offset, len, PCI_WINDOWS_START, PCI_WINDOWS_SIZE);
+  if (windows)
+    {
+      io_window = dev->io_window;
+      mem_window = dev->mem_window;
+      pref_window = dev->pref_window;
+      err = pci_device_parse_windows (dev);
+      if (err)
+	return err;
+      if (memcmp (&io_window, &dev->io_window, sizeof (io_window))
+	  || memcmp (&mem_window, &dev->mem_window, sizeof (mem_window))
+	  || memcmp (&pref_window, &dev->pref_window, sizeof (pref_window)))
+	moved = 1;
+    }
+
+  if (!moved)
+    return 0;
+
+  return pci_index_build ();
+}
+
 /* Read or write from/to the config file */
 error_t
-io_config_file (struct pci_device * dev, off_t offset, size_t * len,
+io_config_file (struct pcifs_dirent * e, off_t offset, size_t * len,
 		void *data, pci_io_op_t op)
 {
   error_t err;
+  struct pci_device *dev;
+
+  dev = e->device;
 
   /* This should never happen */
   assert_backtrace (dev != 0);
@@ -92,12 +231,93 @@ io_config_file (struct pci_device * dev, off_t offset, size_t * len,
 
   pthread_mutex_lock (&fs->pci_conf_lock);
   err = config_block_op (dev, offset, len, data, op);
+  if (!err && op == pci_sys->write)
+    err = config_write_snoop (e->parent, offset, *len, data);
   pthread_mutex_unlock (&fs->pci_conf_lock);
 
   return err;
 }
 
-/* Read the mapped ROM */
+/*
+ * Read or write from/to a block of physical memory belonging to the range
+ * [`base', `base' + `size'), window by window. `prefetchable' tells whether
+ * the range may be accessed with wide, side effect free reads.
+ */
+static error_t
+mem_block_op (pciaddr_t base, pciaddr_t size, off_t offset, size_t * len,
+	      void *data, int prefetchable, int read)
+{
+  error_t err = 0;
+  struct pci_map_window *win;
+  void *addr;
+  size_t pending = *len, avail;
+
+  while (pending > 0)
+    {
+      err = pci_map_acquire (base, size, offset, &addr, &avail, &win);
+      if (err)
+	break;
+
+      if (avail > pending)
+	avail = pending;
+
+      if (read)
+	mmio_read (data, addr, avail, prefetchable);
+      else
+	mmio_write (addr, data, avail, prefetchable);
+
+      pci_map_release (win);
+
+      offset += avail;
+      data += avail;
+      pending -= avail;
+    }
+
+  /* Report a partial transfer as such */
+  if (pending == *len && pending > 0)
+    return err;
+
+  *len -= pending;
+
+  return 0;
+}
+
+/*
+ * Copy the ROM of `dev' into memory, if not done yet.
+ *
+ * The ROM is only read from the hardware once, the decoder being enabled
+ * just for that. Further reads are served from the copy.
+ */
+static error_t
+rom_shadow_load (struct pci_device *dev)
+{
+  error_t err = 0;
+  void *shadow;
+
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  if (!dev->rom_shadow)
+    {
+      shadow = malloc (dev->rom_size);
+      if (!shadow)
+	err = ENOMEM;
+      else
+	{
+	  err = pci_sys->device_read_rom (dev, 0, dev->rom_size, shadow);
+	  if (err)
+	    free (shadow);
+	  else
+	    {
+	      dev->rom_shadow = shadow;
+	      dev->rom_shadow_size = dev->rom_size;
+	    }
+	}
+    }
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+
+  return err;
+}
+
+/* Read the ROM */
 error_t
 read_rom_file (struct pci_device * dev, off_t offset, size_t * len,
 	       void *data)
@@ -107,18 +327,137 @@ read_rom_file (struct pci_device * dev, off_t offset, size_t * len,
   /* This should never happen */
   assert_backtrace (dev != 0);
 
-  /* Refresh the ROM */
-  err = pci_sys->device_refresh (dev, -1, 1);
+  err = rom_shadow_load (dev);
   if (err)
     return err;
 
-  /* Don't exceed the ROM size */
-  if (offset > dev->rom_size)
+  /* Don't exceed the copy */
+  if (offset > dev->rom_shadow_size)
     return EINVAL;
-  if ((offset + *len) > dev->rom_size)
-    *len = dev->rom_size - offset;
+  if ((offset + *len) > dev->rom_shadow_size)
+    *len = dev->rom_shadow_size - offset;
 
-  memcpy (data, dev->rom_memory + offset, *len);
+  memcpy (data, dev->rom_shadow + offset, *len);
+
+  return 0;
+}
+
+/* Name of the file for ROM image `num' of `dev' */
+static void
+rom_image_file_name (struct pci_device *dev, int num, char *name,
+		     size_t size)
+{
+  switch (dev->rom_images[num].code_type)
+    {
+    case PCI_ROM_CODE_X86:
+      snprintf (name, size, "%s%d-x86", FILE_ROM_NAME, num);
+      break;
+    case PCI_ROM_CODE_OFW:
+      snprintf (name, size, "%s%d-ofw", FILE_ROM_NAME, num);
+      break;
+    case PCI_ROM_CODE_HPPA:
+      snprintf (name, size, "%s%d-hppa", FILE_ROM_NAME, num);
+      break;
+    case PCI_ROM_CODE_EFI:
+      snprintf (name, size, "%s%d-efi", FILE_ROM_NAME, num);
+      break;
+    default:
+      snprintf (name, size, "%s%d-%02x", FILE_ROM_NAME, num,
+		dev->rom_images[num].code_type);
+      break;
+    }
+}
+
+/*
+ * Fill the ROM images directory `dir' on first access. The ROM is copied in
+ * memory and its images parsed from the copy.
+ */
+error_t
+rom_images_load (struct pcifs_dirent * dir)
+{
+  error_t err;
+  struct pci_device *dev;
+  struct pcifs_dirent *e;
+  int i;
+
+  if (__atomic_load_n (&dir->dir->filled, __ATOMIC_ACQUIRE))
+    return 0;
+
+  dev = dir->device;
+
+  /* This should never happen */
+  assert_backtrace (dev != 0);
+
+  err = rom_shadow_load (dev);
+  if (err)
+    return err;
+
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  if (!dir->dir->filled)
+    {
+      err = pci_device_parse_rom (dev);
+      if (!err)
+	{
+	  for (i = 0; i < dev->num_rom_images; i++)
+	    {
+	      e = dir->dir->entries[i];
+	      rom_image_file_name (dev, i, e->cold->name, NAME_SIZE);
+	      UPDATE_SIZE (e, dev->rom_images[i].size);
+	    }
+	  pcifs_dir_fill (dir->dir, dev->num_rom_images);
+	  __atomic_store_n (&dir->dir->filled, 1, __ATOMIC_RELEASE);
+	}
+    }
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+
+  return err;
+}
+
+/* Read a single image of the ROM */
+error_t
+read_rom_image_file (struct pcifs_dirent * e, off_t offset, size_t * len,
+		     void *data)
+{
+  struct pci_rom_image *image;
+  size_t num;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  num = e->index;
+  if (num >= e->device->num_rom_images)
+    return EINVAL;
+  image = &e->device->rom_images[num];
+
+  /* Don't exceed the image size, images lie within the copy */
+  if (offset > image->size)
+    return EINVAL;
+  if ((offset + *len) > image->size)
+    *len = image->size - offset;
+
+  memcpy (data, e->device->rom_shadow + image->offset + offset, *len);
+
+  return 0;
+}
+
+/* Read the capabilities index */
+error_t
+read_caps_file (struct pci_device * dev, off_t offset, size_t * len,
+		void *data)
+{
+  size_t size;
+
+  /* This should never happen */
+  assert_backtrace (dev != 0);
+
+  /* Don't exceed the index size */
+  size = dev->num_caps * sizeof (struct pci_cap);
+  if (offset > size)
+    return EINVAL;
+  if ((offset + *len) > size)
+    *len = size - offset;
+
+  memcpy (data, (char *) dev->caps + offset, *len);
 
   return 0;
 }
@@ -177,21 +516,22 @@ error_t
 io_region_file (struct pcifs_dirent * e, off_t offset, size_t * len,
 		void *data, int read)
 {
-  error_t err;
+  error_t err = 0;
   size_t reg_num;
-  struct pci_mem_region *region;
+  struct pci_mem_region *region, copy;
 
   /* This should never happen */
   assert_backtrace (e->device != 0);
 
   /* Get the region */
-  reg_num = strtol (&e->name[strlen (e->name) - 1], 0, 16);
+  reg_num = e->index;
   region = &e->device->regions[reg_num];
 
-  /* Refresh the region */
-  err = pci_sys->device_refresh (e->device, reg_num, -1);
-  if (err)
-    return err;
+  /* Work on a copy, a config write may be moving the BAR */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  copy = *region;
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+  region = &copy;
 
   /* Don't exceed the region size */
   if (offset > region->size)
@@ -201,10 +541,659 @@ io_region_file (struct pcifs_dirent * e, off_t offset, size_t * len,
 
   if (region->is_IO)
     region_block_ioport_op (region->base_addr, offset, len, data, read);
-  else if (read)
-    memcpy (data, region->memory + offset, *len);
   else
-    memcpy (region->memory + offset, data, *len);
+    err = mem_block_op (region->base_addr, region->size, offset, len, data,
+			region->is_prefetchable, read);
+
+  return err;
+}
+
+/* Execute a single register access on a port */
+static void
+reg_op_ioport (struct pci_reg_op *op, uint16_t port)
+{
+  uint32_t old = 0;
+
+  if (op->op != PCI_REG_OP_WRITE)
+    switch (op->width)
+      {
+      case 1:
+	old = inb (port);
+	break;
+      case 2:
+	old = inw (port);
+	break;
+      case 4:
+	old = inl (port);
+	break;
+      }
+
+  if (op->op == PCI_REG_OP_RMW)
+    op->value = (old & ~op->mask) | (op->value & op->mask);
+
+  if (op->op != PCI_REG_OP_READ)
+    switch (op->width)
+      {
+      case 1:
+	outb (op->value, port);
+	break;
+      case 2:
+	outw (op->value, port);
+	break;
+      case 4:
+	outl (op->value, port);
+	break;
+      }
+
+  op->value = old;
+}
+
+/* Execute a single register access on device memory */
+static void
+reg_op_mem (struct pci_reg_op *op, volatile void *addr)
+{
+  uint32_t old = 0;
+
+  if (op->op != PCI_REG_OP_WRITE)
+    switch (op->width)
+      {
+      case 1:
+	old = *(volatile uint8_t *) addr;
+	break;
+      case 2:
+	old = *(volatile uint16_t *) addr;
+	break;
+      case 4:
+	old = *(volatile uint32_t *) addr;
+	break;
+      }
+
+  if (op->op == PCI_REG_OP_RMW)
+    op->value = (old & ~op->mask) | (op->value & op->mask);
+
+  if (op->op != PCI_REG_OP_READ)
+    switch (op->width)
+      {
+      case 1:
+	*(volatile uint8_t *) addr = op->value;
+	break;
+      case 2:
+	*(volatile uint16_t *) addr = op->value;
+	break;
+      case 4:
+	*(volatile uint32_t *) addr = op->value;
+	break;
+      }
+
+  op->value = old;
+}
+
+/*
+ * Execute a batch of register accesses on the regions of the function at
+ * `e', in order.
+ *
+ * Each operation gets its status. The batch stops at the first failure,
+ * `*done' is the number of operations processed, including the failed one.
+ */
+error_t
+exec_reg_ops (struct pcifs_dirent * e, struct pci_reg_op * ops, size_t nops,
+	      size_t * done)
+{
+  error_t err = 0;
+  struct pci_mem_region regions[6], *region;
+  struct pci_map_window *win = 0;
+  pciaddr_t win_base = 0;
+  void *addr;
+  size_t avail, i;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  /* Work on a copy, a config write may be moving the BARs */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  memcpy (regions, e->device->regions, sizeof (regions));
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+
+  for (i = 0; i < nops && !err; i++)
+    {
+      if (ops[i].region >= 6 || ops[i].op > PCI_REG_OP_RMW
+	  || (ops[i].width != 1 && ops[i].width != 2 && ops[i].width != 4)
+	  || ops[i].offset % ops[i].width)
+	{
+	  err = ops[i].status = EINVAL;
+	  continue;
+	}
+
+      region = &regions[ops[i].region];
+      if (ops[i].offset + ops[i].width > region->size)
+	{
+	  err = ops[i].status = EINVAL;
+	  continue;
+	}
+
+      if (region->is_IO)
+	{
+	  reg_op_ioport (&ops[i], region->base_addr + ops[i].offset);
+	  ops[i].status = 0;
+	  continue;
+	}
+
+      /* Consecutive accesses usually hit the same window */
+      if (win && (region->base_addr + ops[i].offset < win->start
+		  || region->base_addr + ops[i].offset >= win->end
+		  || win_base != region->base_addr))
+	{
+	  pci_map_release (win);
+	  win = 0;
+	}
+
+      if (!win)
+	{
+	  err = pci_map_acquire (region->base_addr, region->size,
+				 ops[i].offset, &addr, &avail, &win);
+	  if (err)
+	    {
+	      ops[i].status = err;
+	      win = 0;
+	      continue;
+	    }
+	  win_base = region->base_addr;
+	}
+
+      addr = (void *) (win->addr + (region->base_addr + ops[i].offset
+				    - trunc_page (win->start)));
+      reg_op_mem (&ops[i], addr);
+      ops[i].status = 0;
+    }
+
+  if (win)
+    pci_map_release (win);
+
+  *done = i;
+
+  return err;
+}
+
+/*
+ * Stream a block of data from/to a single I/O port.
+ *
+ * The whole buffer goes through the port at `offset' in the region with
+ * string I/O instructions, dwords first, then a word and a byte for the rest.
+ * Many legacy data ports work like this, and a whole block takes a single
+ * call instead of one per dword.
+ */
+error_t
+io_fifo_file (struct pcifs_dirent * e, off_t offset, size_t * len,
+	      void *data, int read)
+{
+  size_t reg_num, count;
+  struct pci_mem_region *region, copy;
+  uint16_t port;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  /* Get the region */
+  reg_num = e->index;
+  region = &e->device->regions[reg_num];
+
+  /* Work on a copy, a config write may be moving the BAR */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  copy = *region;
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+  region = &copy;
+
+  if (!region->is_IO)
+    return EIO;
+
+  /* The port must be inside the region */
+  if (offset < 0 || offset >= region->size)
+    return EINVAL;
+  port = region->base_addr + offset;
+
+  /* Each access width must fit in the region, not to touch other devices */
+  count = *len / 4;
+  if ((count > 0 && offset + 4 > region->size)
+      || ((*len & 2) && offset + 2 > region->size)
+      || ((*len & 1) && offset + 1 > region->size))
+    return EINVAL;
+
+  if (count > 0)
+    {
+      if (read)
+	insl (port, data, count);
+      else
+	outsl (port, data, count);
+      data += count * 4;
+    }
+
+  if (*len & 2)
+    {
+      if (read)
+	*((unsigned short *) data) = inw (port);
+      else
+	outw (*((unsigned short *) data), port);
+      data += 2;
+    }
+
+  if (*len & 1)
+    {
+      if (read)
+	*((unsigned char *) data) = inb (port);
+      else
+	outb (*((unsigned char *) data), port);
+    }
+
+  return 0;
+}
+
+/*
+ * Read or write from/to the MSI-X table or PBA.
+ *
+ * Both structures only accept aligned dword accesses, so the transfer is done
+ * one dword at a time straight from the region window. The common case of
+ * reading or writing a whole 16-byte entry takes four accesses and no
+ * configuration cycle.
+ */
+error_t
+io_msix_file (struct pcifs_dirent * e, off_t offset, size_t * len,
+	      void *data, int read)
+{
+  error_t err;
+  struct pci_msix *msix;
+  struct pci_mem_region region;
+  struct pci_map_window *win;
+  void *addr;
+  volatile uint32_t *reg;
+  uint32_t *buf;
+  size_t size, avail, i;
+  int is_table, bar;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  /* Only whole, aligned dwords */
+  if ((offset & 3) || (*len & 3))
+    return EINVAL;
+
+  msix = &e->device->msix;
+  is_table = e->kind == FILE_KIND_MSIX_TABLE;
+  if (is_table)
+    {
+      bar = msix->table_bar;
+      size = PCI_MSIX_TABLE_BYTES (msix);
+    }
+  else
+    {
+      bar = msix->pba_bar;
+      size = PCI_MSIX_PBA_BYTES (msix);
+    }
+
+  /* Work on a copy, a config write may be moving the BAR */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  region = e->device->regions[bar];
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+
+  if (region.is_IO || region.size == 0)
+    return EIO;
+
+  /* Nothing to transfer at or past the end, the window may not reach there */
+  if (offset >= size)
+    {
+      *len = 0;
+      return 0;
+    }
+
+  /* Don't exceed the structure size */
+  if ((offset + *len) > size)
+    *len = size - offset;
+
+  /* Both structures are far smaller than a window */
+  offset += is_table ? msix->table_offset : msix->pba_offset;
+  err = pci_map_acquire (region.base_addr, region.size, offset, &addr,
+			 &avail, &win);
+  if (err)
+    return err;
+  if (avail < *len)
+    *len = avail;
+
+  /* A window cut the transfer in the middle of a dword */
+  if (*len & 3)
+    {
+      pci_map_release (win);
+      return EINVAL;
+    }
+
+  reg = addr;
+  buf = data;
+  for (i = 0; i < *len / 4; i++)
+    {
+      if (read)
+	buf[i] = reg[i];
+      else
+	reg[i] = buf[i];
+    }
+
+  pci_map_release (win);
+
+  return 0;
+}
+
+/* Link speeds, in GT/s, indexed by their encoding */
+static const char *link_speeds[] =
+  { "?", "2.5", "5.0", "8.0", "16.0", "32.0", "64.0" };
+
+#define LINK_SPEED_STR(speed) \
+  ((speed) < sizeof (link_speeds) / sizeof (*link_speeds) ? \
+   link_speeds[speed] : "?")
+
+/* Maximum number of bridges between a device and its root bus */
+#define TOPOLOGY_MAX_DEPTH 256
+
+/*
+ * Generate the topology view of `dev':
+ *
+ *   path 0000:00:1c.0 0000:02:00.0
+ *   speed 5.0 8.0
+ *   width 4 16
+ *   buses 03-05
+ *
+ * `path' lists all bridges from the root bus down to the device itself.
+ * `speed' and `width' are the negotiated and the maximum link speed in GT/s
+ * and width in lanes, only for PCI Express devices. `buses' is the bus
+ * range behind bridges.
+ *
+ * The caller must free `*buf'.
+ */
+static error_t
+topology_fmt (struct pci_device *dev, char **buf, size_t * size)
+{
+  FILE *stream;
+  struct pci_device *d;
+  int32_t path[TOPOLOGY_MAX_DEPTH];
+  int i, depth;
+
+  /* Walk up to the root bus */
+  path[0] = dev - pci_sys->devices;
+  for (depth = 1; depth < TOPOLOGY_MAX_DEPTH; depth++)
+    {
+      path[depth] = pci_sys->devices[path[depth - 1]].upstream;
+      if (path[depth] < 0)
+	break;
+    }
+
+  stream = open_memstream (buf, size);
+  if (!stream)
+    return errno;
+
+  fprintf (stream, "path");
+  for (i = depth - 1; i >= 0; i--)
+    {
+      d = &pci_sys->devices[path[i]];
+      fprintf (stream, " %04x:%02x:%02x.%01u", d->domain, d->bus, d->dev,
+	       d->func);
+    }
+  fprintf (stream, "\n");
+
+  if (dev->link.cap && dev->link.max_width)
+    {
+      fprintf (stream, "speed %s %s\n", LINK_SPEED_STR (dev->link.speed),
+	       LINK_SPEED_STR (dev->link.max_speed));
+      fprintf (stream, "width %u %u\n", dev->link.width,
+	       dev->link.max_width);
+    }
+
+  if (dev->secondary_bus)
+    fprintf (stream, "buses %02x-%02x\n", dev->secondary_bus,
+	     dev->subordinate_bus);
+
+  if (fclose (stream))
+    return errno;
+
+  return 0;
+}
+
+/* Get the current size of the topology file */
+error_t
+topology_file_size (struct pci_device * dev, size_t * size)
+{
+  error_t err;
+  char *buf;
+
+  err = topology_fmt (dev, &buf, size);
+  if (err)
+    return err;
+
+  free (buf);
+
+  return 0;
+}
+
+/* Read the topology file, with the current link status */
+error_t
+read_topology_file (struct pcifs_dirent * e, off_t offset, size_t * len,
+		    void *data)
+{
+  error_t err;
+  char *buf;
+  size_t size;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  /* The link may have been retrained */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  err = pci_device_refresh_link (e->device);
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+  if (err)
+    return err;
+
+  err = topology_fmt (e->device, &buf, &size);
+  if (err)
+    return err;
+
+  /* The size changes along with the link */
+  UPDATE_SIZE (e, size);
+
+  /* Don't exceed the view size */
+  if (offset > size)
+    {
+      free (buf);
+      return EINVAL;
+    }
+  if ((offset + *len) > size)
+    *len = size - offset;
+
+  memcpy (data, buf + offset, *len);
+  free (buf);
+
+  return 0;
+}
+
+/*
+ * Generate the node cache and pool statistics:
+ *
+ *   hits 1042
+ *   misses 57
+ *   evictions 12
+ *   size 40
+ *   capacity 48
+ *   pool-size 320
+ *   pool-used 52
+ *   pool-peak 75
+ *
+ * `size' is the number of nodes in the cache and `capacity' how many it may
+ * hold now, which grows up to the --ncache length. The `pool-' lines tell
+ * how many nodes the pool holds, and how many of them are in use now and
+ * were at most.
+ *
+ * The caller must free `*buf'.
+ */
+static error_t
+stats_fmt (char **buf, size_t * size)
+{
+  FILE *stream;
+  struct ncache_stats stats;
+  struct npool_stats pool;
+
+  node_cache_stats (&stats);
+  node_pool_stats (&pool);
+
+  stream = open_memstream (buf, size);
+  if (!stream)
+    return errno;
+
+  fprintf (stream, "hits %llu\n", (unsigned long long) stats.hits);
+  fprintf (stream, "misses %llu\n", (unsigned long long) stats.misses);
+  fprintf (stream, "evictions %llu\n", (unsigned long long) stats.evictions);
+  fprintf (stream, "size %zu\n", stats.len);
+  fprintf (stream, "capacity %zu\n", stats.size);
+  fprintf (stream, "pool-size %zu\n", pool.size);
+  fprintf (stream, "pool-used %zu\n", pool.used);
+  fprintf (stream, "pool-peak %zu\n", pool.peak);
+
+  if (fclose (stream))
+    return errno;
+
+  return 0;
+}
+
+/* Get the current size of the stats file */
+error_t
+stats_file_size (size_t * size)
+{
+  error_t err;
+  char *buf;
+
+  err = stats_fmt (&buf, size);
+  if (err)
+    return err;
+
+  free (buf);
+
+  return 0;
+}
+
+/* Read the node cache statistics */
+error_t
+read_stats_file (struct pcifs_dirent * e, off_t offset, size_t * len,
+		 void *data)
+{
+  error_t err;
+  char *buf;
+  size_t size;
+
+  err = stats_fmt (&buf, &size);
+  if (err)
+    return err;
+
+  UPDATE_SIZE (e, size);
+
+  /* Don't exceed the view size */
+  if (offset > size)
+    {
+      free (buf);
+      return EINVAL;
+    }
+  if ((offset + *len) > size)
+    *len = size - offset;
+
+  memcpy (data, buf + offset, *len);
+  free (buf);
 
   return 0;
 }
+
+/*
+ * Get a memory object covering `size' bytes of physical memory from `addr'
+ * on, not allowing more than `prot' access.
+ *
+ * Only whole pages are mapped. Smaller or unaligned ranges are still reachable
+ * through read and write.
+ */
+static error_t
+get_phys_filemap (pciaddr_t addr, pciaddr_t size, vm_prot_t prot,
+		  memory_object_t * proxy)
+{
+  error_t err;
+  memory_object_t obj;
+  vm_offset_t offset, start, len;
+
+  /* Memory out of our reach can't be mapped */
+  if (size > (vm_offset_t) - 1 || addr > (vm_offset_t) - 1 - size)
+    return EOPNOTSUPP;
+
+  /* Mapping a partial page would expose whatever else decodes in it */
+  if (size < vm_page_size || (addr & (vm_page_size - 1))
+      || (size & (vm_page_size - 1)))
+    return EOPNOTSUPP;
+
+  err = pci_map_get_object (prot, &obj);
+  if (err)
+    return err;
+
+  offset = addr;
+  start = 0;
+  len = size;
+  err = memory_object_create_proxy (mach_task_self (), prot, &obj, 1,
+				    &offset, 1, &start, 1, &len, 1, proxy);
+  mach_port_deallocate (mach_task_self (), obj);
+
+  return err;
+}
+
+/*
+ * Get a memory object covering the physical range of the region in `e', for
+ * clients to map it in their own space. The object won't allow more than
+ * `prot' access.
+ */
+error_t
+get_region_filemap (struct pcifs_dirent * e, vm_prot_t prot,
+		    memory_object_t * proxy)
+{
+  size_t reg_num;
+  struct pci_mem_region *region, copy;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  /* Get the region */
+  reg_num = e->index;
+  region = &e->device->regions[reg_num];
+
+  /* Work on a copy, a config write may be moving the BAR */
+  pthread_mutex_lock (&fs->pci_conf_lock);
+  copy = *region;
+  pthread_mutex_unlock (&fs->pci_conf_lock);
+  region = &copy;
+
+  /* I/O ports can't be mapped */
+  if (region->is_IO)
+    return EOPNOTSUPP;
+
+  return get_phys_filemap (region->base_addr, region->size, prot, proxy);
+}
+
+/*
+ * Get a read only memory object covering the configuration space window of
+ * the device in `e', if the backend has memory-mapped configuration space.
+ */
+error_t
+get_config_filemap (struct pcifs_dirent * e, memory_object_t * proxy)
+{
+  error_t err;
+  pciaddr_t addr;
+
+  /* This should never happen */
+  assert_backtrace (e->device != 0);
+
+  if (!pci_sys->device_config_addr)
+    return EOPNOTSUPP;
+
+  err = pci_sys->device_config_addr (e->device, &addr);
+  if (err)
+    return err;
+
+  return get_phys_filemap (addr, PCI_CONFIG_WINDOW_SIZE, VM_PROT_READ,
+			   proxy);
+}
@@ -27,18 +27,97 @@
 /* Config */
 #define FILE_CONFIG_NAME  "config"
 
-/* Rom */
+/* Rom, images are named after it: rom0-x86, rom1-efi... */
 #define FILE_ROM_NAME     "rom"
 
+/* Directory holding the ROM images */
+#define FILE_ROM_IMAGES_NAME     "rom-images"
+
 /* Region */
 #define FILE_REGION_NAME     "region"
 
-error_t io_config_file (struct pci_device * dev, off_t offset, size_t * len,
+/* Single port streaming on I/O regions */
+#define FILE_FIFO_NAME     "fifo"
+
+/* Capabilities */
+#define FILE_CAPS_NAME     "caps"
+
+/* Topology: upstream path and link */
+#define FILE_TOPOLOGY_NAME     "topology"
+
+/* Node cache statistics, at the root */
+#define FILE_STATS_NAME     "stats"
+
+/* MSI-X table and Pending Bit Array */
+#define FILE_MSIX_TABLE_NAME     "msix-table"
+#define FILE_MSIX_PBA_NAME     "msix-pba"
+
+error_t config_write_snoop (struct pcifs_dirent *dir, off_t offset,
+			    size_t len, const void *data);
+
+/* Register operations, for batches */
+#define PCI_REG_OP_READ		0
+#define PCI_REG_OP_WRITE	1
+#define PCI_REG_OP_RMW		2	/* value = (value & ~mask) | new */
+
+/*
+ * A register access in a batch. On completion, `value' holds the value read
+ * for reads and RMWs, and `status' the result of the operation.
+ */
+struct pci_reg_op
+{
+  uint8_t region;
+  uint8_t width;		/* 1, 2 or 4 bytes */
+  uint8_t op;
+  uint8_t pad;
+  uint32_t offset;
+  uint32_t value;
+  uint32_t mask;
+  int32_t status;
+};
+
+/* Ports returned by pci_open_dev, one per file, null when missing */
+#define PCI_OPEN_DEV_CONFIG	0
+#define PCI_OPEN_DEV_REGION(n)	(1 + (n))
+#define PCI_OPEN_DEV_ROM	7
+#define PCI_OPEN_DEV_PORTS	8
+
+error_t io_config_file (struct pcifs_dirent *e, off_t offset, size_t * len,
 			void *data, pci_io_op_t op);
 
 error_t read_rom_file (struct pci_device *dev, off_t offset, size_t * len,
 		       void *data);
 
+error_t rom_images_load (struct pcifs_dirent *dir);
+
+error_t read_rom_image_file (struct pcifs_dirent *e, off_t offset,
+			     size_t * len, void *data);
+
 error_t io_region_file (struct pcifs_dirent *e, off_t offset, size_t * len,
 			void *data, int read);
+
+error_t io_fifo_file (struct pcifs_dirent *e, off_t offset, size_t * len,
+		      void *data, int read);
+
+error_t read_caps_file (struct pci_device *dev, off_t offset, size_t * len,
+			void *data);
+
+error_t io_msix_file (struct pcifs_dirent *e, off_t offset, size_t * len,
+		      void *data, int read);
+
+error_t topology_file_size (struct pci_device *dev, size_t * size);
+
+error_t stats_file_size (size_t * size);
+error_t read_stats_file (struct pcifs_dirent *e, off_t offset, size_t * len,
+			 void *data);
+error_t read_topology_file (struct pcifs_dirent *e, off_t offset,
+			    size_t * len, void *data);
+
+error_t get_region_filemap (struct pcifs_dirent *e, vm_prot_t prot,
+			    memory_object_t * proxy);
+
+error_t get_config_filemap (struct pcifs_dirent *e, memory_object_t * proxy);
+
+error_t exec_reg_ops (struct pcifs_dirent *e, struct pci_reg_op *ops,
+		      size_t nops, size_t * done);
 #endif /* FUNC_FILES_H */
@@ -35,7 +35,9 @@
 #include "libports/interrupt_S.h"
 #include "libnetfs/ifsock_S.h"
 #include <pci_access.h>
+#include <pci_index.h>
 #include <pcifs.h>
+#include <npool.h>
 #include <startup.h>
 
 /* Libnetfs stuff */
@@ -90,6 +92,11 @@ main (int argc, char **argv)
   if (err)
     error (1, err, "Starting the PCI system");
 
+  /* Index the address space */
+  err = pci_index_build ();
+  if (err)
+    error (1, err, "Building the address index");
+
   /* Create the PCI filesystem */
   err = init_file_system (netfs_startup (bootstrap, O_READ), fs);
   if (err)
@@ -100,11 +107,24 @@ main (int argc, char **argv)
   if (err)
     error (1, err, "Creating the PCI filesystem tree");
 
+  /* One node per entry at most, but the root's */
+  err = node_pool_init (fs->num_entries - 1);
+  if (err)
+    error (1, err, "Creating the node pool");
+
   /* Set permissions */
   err = fs_set_permissions (fs);
   if (err)
     error (1, err, "Setting permissions");
 
+  /* Create all nodes now if asked to */
+  if (fs->params.pin_nodes)
+    {
+      err = fs_pin_nodes (fs);
+      if (err)
+	error (1, err, "Pinning the filesystem nodes");
+    }
+
   /*
    * Ask init to tell us when the system is going down,
    * so we can try to be friendly to our correspondents on the network.
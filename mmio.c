@@ -0,0 +1,274 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Device memory copy engine.
+ *
+ * memcpy() gives no guarantee about the width or alignment of the accesses
+ * it does, which registers may not tolerate. Here every access to device
+ * memory is naturally aligned: unaligned heads and tails are moved with
+ * narrower accesses, and the body with the widest one allowed.
+ *
+ * Non-prefetchable memory gets 32-bit accesses, or 64-bit ones on 64-bit
+ * hosts. Prefetchable memory has no side effects on reads, so its body is
+ * moved with 16-byte vector accesses when the CPU supports SSE2.
+ *
+ * Writes to prefetchable memory use non-temporal stores, which the CPU is
+ * free to combine into burst transactions when the range is write-combining.
+ * Mach gives us no control over the memory type of our mappings, so that
+ * depends on how the firmware set up the MTRRs. Either way, a store fence
+ * ends every such write so it's globally visible before we return.
+ */
+
+#include <mmio.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#define MMIO_HAVE_VECTOR 1
+#endif
+
+#ifdef __x86_64__
+typedef uint64_t mmio_word_t;
+#else
+typedef uint32_t mmio_word_t;
+#endif
+
+#define MMIO_ALIGNED(addr, size) (((uintptr_t) (addr) & ((size) - 1)) == 0)
+
+/*
+ * Move at most `*len' bytes with single naturally aligned accesses until
+ * the device address is aligned to `align' bytes. `dev' is the device side
+ * of the copy.
+ */
+static void
+mmio_head (volatile char **dev, char **buf, size_t * len, size_t align,
+	   int read)
+{
+  while (*len > 0 && !MMIO_ALIGNED (*dev, align))
+    {
+      if (*len >= 4 && MMIO_ALIGNED (*dev, 4))
+	{
+	  uint32_t v;
+
+	  if (read)
+	    {
+	      v = *(volatile uint32_t *) *dev;
+	      memcpy (*buf, &v, 4);
+	    }
+	  else
+	    {
+	      memcpy (&v, *buf, 4);
+	      *(volatile uint32_t *) *dev = v;
+	    }
+	  *dev += 4;
+	  *buf += 4;
+	  *len -= 4;
+	}
+      else if (*len >= 2 && MMIO_ALIGNED (*dev, 2))
+	{
+	  uint16_t v;
+
+	  if (read)
+	    {
+	      v = *(volatile uint16_t *) *dev;
+	      memcpy (*buf, &v, 2);
+	    }
+	  else
+	    {
+	      memcpy (&v, *buf, 2);
+	      *(volatile uint16_t *) *dev = v;
+	    }
+	  *dev += 2;
+	  *buf += 2;
+	  *len -= 2;
+	}
+      else
+	{
+	  if (read)
+	    **buf = *(volatile uint8_t *) *dev;
+	  else
+	    *(volatile uint8_t *) *dev = **buf;
+	  *dev += 1;
+	  *buf += 1;
+	  *len -= 1;
+	}
+    }
+}
+
+/* Move the tail, less than a word, with narrower accesses */
+static void
+mmio_tail (volatile char *dev, char *buf, size_t len, int read)
+{
+  /* The device address is word aligned here */
+  mmio_head (&dev, &buf, &len, 1, read);
+  while (len > 0)
+    {
+      if (len >= 4)
+	{
+	  uint32_t v;
+
+	  if (read)
+	    {
+	      v = *(volatile uint32_t *) dev;
+	      memcpy (buf, &v, 4);
+	    }
+	  else
+	    {
+	      memcpy (&v, buf, 4);
+	      *(volatile uint32_t *) dev = v;
+	    }
+	  dev += 4;
+	  buf += 4;
+	  len -= 4;
+	}
+      else if (len >= 2)
+	{
+	  uint16_t v;
+
+	  if (read)
+	    {
+	      v = *(volatile uint16_t *) dev;
+	      memcpy (buf, &v, 2);
+	    }
+	  else
+	    {
+	      memcpy (&v, buf, 2);
+	      *(volatile uint16_t *) dev = v;
+	    }
+	  dev += 2;
+	  buf += 2;
+	  len -= 2;
+	}
+      else
+	{
+	  if (read)
+	    *buf = *(volatile uint8_t *) dev;
+	  else
+	    *(volatile uint8_t *) dev = *buf;
+	  dev++;
+	  buf++;
+	  len--;
+	}
+    }
+}
+
+/* Move the body with word accesses, return the bytes left */
+static size_t
+mmio_words (volatile char **dev, char **buf, size_t len, int read)
+{
+  mmio_word_t v;
+
+  while (len >= sizeof (mmio_word_t))
+    {
+      if (read)
+	{
+	  v = *(volatile mmio_word_t *) *dev;
+	  memcpy (*buf, &v, sizeof (v));
+	}
+      else
+	{
+	  memcpy (&v, *buf, sizeof (v));
+	  *(volatile mmio_word_t *) *dev = v;
+	}
+      *dev += sizeof (mmio_word_t);
+      *buf += sizeof (mmio_word_t);
+      len -= sizeof (mmio_word_t);
+    }
+
+  return len;
+}
+
+#ifdef MMIO_HAVE_VECTOR
+/* Move the body with 16-byte accesses, return the bytes left */
+__attribute__ ((target ("sse2")))
+static size_t
+mmio_vectors (volatile char **dev, char **buf, size_t len, int read)
+{
+  __m128i v;
+
+  while (len >= sizeof (__m128i))
+    {
+      if (read)
+	{
+	  v = _mm_load_si128 ((__m128i *) * dev);
+	  _mm_storeu_si128 ((__m128i *) * buf, v);
+	}
+      else
+	{
+	  v = _mm_loadu_si128 ((__m128i *) * buf);
+	  _mm_stream_si128 ((__m128i *) * dev, v);
+	}
+      *dev += sizeof (__m128i);
+      *buf += sizeof (__m128i);
+      len -= sizeof (__m128i);
+    }
+
+  /* Flush the combining buffers */
+  if (!read)
+    _mm_sfence ();
+
+  return len;
+}
+
+/* Whether vector accesses may be used, checked once */
+static int
+mmio_vector_ok (void)
+{
+  static int ok = -1;
+
+  if (ok < 0)
+    ok = __builtin_cpu_supports ("sse2");
+
+  return ok;
+}
+#endif
+
+static void
+mmio_copy (volatile char *dev, char *buf, size_t len, int prefetchable,
+	   int read)
+{
+#ifdef MMIO_HAVE_VECTOR
+  if (prefetchable && len >= 2 * sizeof (__m128i) && mmio_vector_ok ())
+    {
+      mmio_head (&dev, &buf, &len, sizeof (__m128i), read);
+      len = mmio_vectors (&dev, &buf, len, read);
+    }
+#endif
+
+  mmio_head (&dev, &buf, &len, sizeof (mmio_word_t), read);
+  len = mmio_words (&dev, &buf, len, read);
+  mmio_tail (dev, buf, len, read);
+}
+
+/* Read `len' bytes from device memory at `src' */
+void
+mmio_read (void *dst, const volatile void *src, size_t len, int prefetchable)
+{
+  mmio_copy ((volatile char *) src, dst, len, prefetchable, 1);
+}
+
+/* Write `len' bytes to device memory at `dst' */
+void
+mmio_write (volatile void *dst, const void *src, size_t len, int prefetchable)
+{
+  mmio_copy (dst, (char *) src, len, prefetchable, 0);
+}
@@ -0,0 +1,32 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Header for the device memory copy engine */
+
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <stddef.h>
+
+void mmio_read (void *dst, const volatile void *src, size_t len,
+		int prefetchable);
+void mmio_write (volatile void *dst, const void *src, size_t len,
+		 int prefetchable);
+
+#endif /* MMIO_H */
@@ -21,6 +21,7 @@
 #include <ncache.h>
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <hurd/netfs.h>
 
@@ -29,22 +30,185 @@
 
 /* Implementation of node caching functions */
 
-/* Remove NN's node from its position in FS's node cache.  */
-void
-node_unlink (struct node *node, struct pcifs *fs)
+/*
+ * The cache is split in shards, an entry always going to the same one. Each
+ * shard follows CAR (CLOCK with Adaptive Replacement): entries seen once live
+ * in `t1' and entries seen again in `t2', both swept like a CLOCK. The ghost
+ * lists `b1' and `b2' remember what was recently evicted from each, and a
+ * miss on a ghost moves the target length of `t1' towards the list that
+ * would have kept it. A scan only goes through `t1', so it can't push out
+ * the nodes in `t2' that are used over and over.
+ *
+ * A ghost hit also means the shard was too short for the working set, so it
+ * then grows by one, up to its share of the maximum set by --ncache.
+ *
+ * Hits only set the entry's reference bit, without taking any lock. They
+ * are counted per thread and folded into the shard statistics in batches,
+ * so the count may lag behind by a few hits per thread.
+ */
+
+/* Hits a thread counts before folding them */
+#define NCACHE_HITS_BATCH 64
+
+/* How many nodes to evict before releasing them when shrinking */
+#define NCACHE_EVICT_BATCH 16
+
+/* Hits of this thread not yet in the statistics */
+static __thread unsigned int hits_pending;
+
+/* Count a hit in `shard' */
+static void
+shard_hit (struct pcifs_ncache_shard *shard)
+{
+  if (++hits_pending < NCACHE_HITS_BATCH)
+    return;
+
+  __atomic_add_fetch (&shard->hits, hits_pending, __ATOMIC_RELAXED);
+  hits_pending = 0;
+}
+
+/* Shard for `e' */
+static struct pcifs_ncache_shard *
+entry_shard (struct pcifs_dirent *e)
+{
+  return &fs->node_cache[(e - fs->entries) % NODE_CACHE_SHARDS];
+}
+
+/* List `which' of `shard' */
+static struct pcifs_ncache_list *
+shard_list (struct pcifs_ncache_shard *shard, uint8_t which)
+{
+  switch (which)
+    {
+    case NCACHE_T1:
+      return &shard->t1;
+    case NCACHE_T2:
+      return &shard->t2;
+    case NCACHE_B1:
+      return &shard->b1;
+    default:
+      return &shard->b2;
+    }
+}
+
+static void
+list_remove (struct pcifs_ncache_shard *shard, struct pcifs_dirent *e)
 {
-  struct netnode *nn = node->nn;
-  if (nn->ncache_next)
-    nn->ncache_next->nn->ncache_prev = nn->ncache_prev;
-  if (nn->ncache_prev)
-    nn->ncache_prev->nn->ncache_next = nn->ncache_next;
-  if (fs->node_cache_mru == node)
-    fs->node_cache_mru = nn->ncache_next;
-  if (fs->node_cache_lru == node)
-    fs->node_cache_lru = nn->ncache_prev;
-  nn->ncache_next = 0;
-  nn->ncache_prev = 0;
-  fs->node_cache_len--;
+  struct pcifs_ncache_list *list = shard_list (shard, e->ncache_list);
+
+  if (e->ncache_prev)
+    e->ncache_prev->ncache_next = e->ncache_next;
+  else
+    list->head = e->ncache_next;
+  if (e->ncache_next)
+    e->ncache_next->ncache_prev = e->ncache_prev;
+  else
+    list->tail = e->ncache_prev;
+  list->len--;
+
+  e->ncache_next = e->ncache_prev = 0;
+  __atomic_store_n (&e->ncache_list, NCACHE_NONE, __ATOMIC_RELEASE);
+}
+
+/* Add `e' at the tail of list `which' */
+static void
+list_append (struct pcifs_ncache_shard *shard, uint8_t which,
+	     struct pcifs_dirent *e)
+{
+  struct pcifs_ncache_list *list = shard_list (shard, which);
+
+  e->ncache_next = 0;
+  e->ncache_prev = list->tail;
+  if (list->tail)
+    list->tail->ncache_next = e;
+  else
+    list->head = e;
+  list->tail = e;
+  list->len++;
+
+  __atomic_store_n (&e->ncache_list, which, __ATOMIC_RELEASE);
+}
+
+/* Move `e' to the tail of list `which' */
+static void
+list_move (struct pcifs_ncache_shard *shard, uint8_t which,
+	   struct pcifs_dirent *e)
+{
+  list_remove (shard, e);
+  list_append (shard, which, e);
+}
+
+/*
+ * Evict a node from `t1' or `t2' into the matching ghost list and return
+ * it. The cache reference is still to be released.
+ */
+static struct node *
+shard_replace (struct pcifs_ncache_shard *shard)
+{
+  struct pcifs_dirent *e;
+  struct node *node;
+
+  for (;;)
+    {
+      if (shard->t1.len > 0 && shard->t1.len >= (shard->p ? shard->p : 1))
+	{
+	  e = shard->t1.head;
+	  if (!__atomic_exchange_n (&e->ncache_ref, 0, __ATOMIC_RELAXED))
+	    {
+	      list_move (shard, NCACHE_B1, e);
+	      break;
+	    }
+	  /* Seen again while in t1, promote it */
+	  list_move (shard, NCACHE_T2, e);
+	}
+      else
+	{
+	  e = shard->t2.head;
+	  if (!__atomic_exchange_n (&e->ncache_ref, 0, __ATOMIC_RELAXED))
+	    {
+	      list_move (shard, NCACHE_B2, e);
+	      break;
+	    }
+	  list_move (shard, NCACHE_T2, e);
+	}
+    }
+
+  node = e->node;
+  shard->evictions++;
+
+  return node;
+}
+
+/* Keep the ghost lists within what CAR allows for the current size */
+static void
+shard_trim_ghosts (struct pcifs_ncache_shard *shard)
+{
+  while (shard->b1.len > 0 && shard->t1.len + shard->b1.len > shard->size)
+    list_remove (shard, shard->b1.head);
+  while (shard->b2.len > 0
+	 && shard->t1.len + shard->t2.len + shard->b1.len + shard->b2.len >
+	 2 * shard->size)
+    list_remove (shard, shard->b2.head);
+}
+
+/*
+ * Shrink `shard' to `size', evicting at most `room' nodes into `evicted'.
+ * Return how many.
+ */
+static size_t
+shard_shrink (struct pcifs_ncache_shard *shard, size_t size,
+	      struct node **evicted, size_t room)
+{
+  size_t n = 0;
+
+  shard->size = size;
+  if (shard->p > size)
+    shard->p = size;
+  while (n < room && shard->t1.len + shard->t2.len > size)
+    evicted[n++] = shard_replace (shard);
+  shard_trim_ghosts (shard);
+
+  return n;
 }
 
 /* Add NODE to the recently-used-node cache, which adds a reference to
@@ -52,39 +216,131 @@ node_unlink (struct node *node, struct pcifs *fs)
 void
 node_cache (struct node *node)
 {
-  struct netnode *nn = node->nn;
+  struct pcifs_dirent *e = node->nn->ln;
+  struct pcifs_ncache_shard *shard;
+  struct node *evicted[NCACHE_EVICT_BATCH + 1];
+  size_t max, n, i, delta;
+  uint8_t list;
 
-  pthread_mutex_lock (&fs->node_cache_lock);
+  shard = entry_shard (e);
 
-  if (fs->params.node_cache_max > 0 || fs->node_cache_len > 0)
+  list = __atomic_load_n (&e->ncache_list, __ATOMIC_ACQUIRE);
+  if (list == NCACHE_T1 || list == NCACHE_T2)
     {
-      if (fs->node_cache_mru != node)
-	{
-	  if (nn->ncache_next || nn->ncache_prev)
-	    /* Node is already in the cache.  */
-	    node_unlink (node, fs);
-	  else
-	    /* Add a reference from the cache.  */
-	    netfs_nref (node);
-
-	  nn->ncache_next = fs->node_cache_mru;
-	  nn->ncache_prev = 0;
-	  if (fs->node_cache_mru)
-	    fs->node_cache_mru->nn->ncache_prev = node;
-	  if (!fs->node_cache_lru)
-	    fs->node_cache_lru = node;
-	  fs->node_cache_mru = node;
-	  fs->node_cache_len++;
-	}
+      /* Hit */
+      __atomic_store_n (&e->ncache_ref, 1, __ATOMIC_RELAXED);
+      shard_hit (shard);
+      return;
+    }
+
+  max = (fs->params.node_cache_max + NODE_CACHE_SHARDS - 1)
+    / NODE_CACHE_SHARDS;
+
+  pthread_mutex_lock (&shard->lock);
 
-      /* Forget the least used nodes.  */
-      while (fs->node_cache_len > fs->params.node_cache_max)
+  /* Follow changes to the maximum, a batch at a time */
+  n = 0;
+  if (shard->size > max)
+    {
+      n = shard_shrink (shard, max, evicted, NCACHE_EVICT_BATCH);
+      while (shard->t1.len + shard->t2.len > max)
 	{
-	  struct node *lru = fs->node_cache_lru;
-	  node_unlink (lru, fs);
-	  netfs_nrele (lru);
+	  pthread_mutex_unlock (&shard->lock);
+	  for (i = 0; i < n; i++)
+	    netfs_nrele (evicted[i]);
+	  pthread_mutex_lock (&shard->lock);
+	  n = shard_shrink (shard, max, evicted, NCACHE_EVICT_BATCH);
 	}
     }
+  else if (shard->size == 0)
+    shard->size = max < NODE_CACHE_SHARD_INIT ? max : NODE_CACHE_SHARD_INIT;
+
+  /* Shrinking may have dropped it from the ghosts, and another thread
+     may have cached it meanwhile */
+  list = e->ncache_list;
+  if (list == NCACHE_T1 || list == NCACHE_T2)
+    {
+      e->ncache_ref = 1;
+      shard_hit (shard);
+      pthread_mutex_unlock (&shard->lock);
+      for (i = 0; i < n; i++)
+	netfs_nrele (evicted[i]);
+      return;
+    }
+  __atomic_add_fetch (&shard->misses, 1, __ATOMIC_RELAXED);
+
+  /* A miss is slow anyway, fold the hits counted so far */
+  if (hits_pending)
+    {
+      __atomic_add_fetch (&shard->hits, hits_pending, __ATOMIC_RELAXED);
+      hits_pending = 0;
+    }
+
+  if (shard->size == 0)
+    {
+      /* Caching is disabled */
+      pthread_mutex_unlock (&shard->lock);
+      for (i = 0; i < n; i++)
+	netfs_nrele (evicted[i]);
+      return;
+    }
+
+  if (list == NCACHE_B1)
+    {
+      /* Recency would have kept it, favor t1 */
+      delta = shard->b2.len > shard->b1.len ?
+	shard->b2.len / shard->b1.len : 1;
+      shard->p = shard->p + delta < shard->size ? shard->p + delta
+	: shard->size;
+      if (shard->size < max)
+	shard->size++;
+    }
+  else if (list == NCACHE_B2)
+    {
+      /* Frequency would have kept it, favor t2 */
+      delta = shard->b1.len > shard->b2.len ?
+	shard->b1.len / shard->b2.len : 1;
+      shard->p = shard->p > delta ? shard->p - delta : 0;
+      if (shard->size < max)
+	shard->size++;
+    }
+
+  if (shard->t1.len + shard->t2.len >= shard->size)
+    evicted[n++] = shard_replace (shard);
 
-  pthread_mutex_unlock (&fs->node_cache_lock);
+  /* Add a reference from the cache.  */
+  netfs_nref (node);
+  e->ncache_ref = 0;
+  if (list == NCACHE_NONE)
+    list_append (shard, NCACHE_T1, e);
+  else
+    list_move (shard, NCACHE_T2, e);
+  shard_trim_ghosts (shard);
+
+  pthread_mutex_unlock (&shard->lock);
+
+  /* Forget the evicted nodes.  */
+  for (i = 0; i < n; i++)
+    netfs_nrele (evicted[i]);
+}
+
+/* Sum up the statistics of all shards */
+void
+node_cache_stats (struct ncache_stats *stats)
+{
+  struct pcifs_ncache_shard *shard;
+  int i;
+
+  memset (stats, 0, sizeof (struct ncache_stats));
+  for (i = 0; i < NODE_CACHE_SHARDS; i++)
+    {
+      shard = &fs->node_cache[i];
+      pthread_mutex_lock (&shard->lock);
+      stats->hits += __atomic_load_n (&shard->hits, __ATOMIC_RELAXED);
+      stats->misses += __atomic_load_n (&shard->misses, __ATOMIC_RELAXED);
+      stats->evictions += shard->evictions;
+      stats->len += shard->t1.len + shard->t2.len;
+      stats->size += shard->size;
+      pthread_mutex_unlock (&shard->lock);
+    }
 }
@@ -26,7 +26,24 @@
 
 #include <pcifs.h>
 
+/* Lists an entry can be in */
+#define NCACHE_NONE	0
+#define NCACHE_T1	1
+#define NCACHE_T2	2
+#define NCACHE_B1	3
+#define NCACHE_B2	4
+
+/* Totals over all shards */
+struct ncache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t len;
+  size_t size;
+};
+
 void node_cache (struct node *node);
-void node_unlink (struct node *node, struct pcifs *fs);
+void node_cache_stats (struct ncache_stats *stats);
 
 #endif /* NCACHE_H */
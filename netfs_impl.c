@@ -30,23 +30,13 @@
 #include <sys/mman.h>
 #include <hurd/netfs.h>
 
+#include "libnetfs/io_S.h"
 #include <pcifs.h>
 #include <ncache.h>
+#include <npool.h>
 #include <pci_access.h>
 #include <func_files.h>
 
-#define DIRENTS_CHUNK_SIZE      (8*1024)
-/* Returned directory entries are aligned to blocks this many bytes long.
- * Must be a power of two.  */
-#define DIRENT_ALIGN 4
-#define DIRENT_NAME_OFFS offsetof (struct dirent, d_name)
-
-/* Length is structure before the name + the name + '\0', all
- *    padded to a four-byte alignment.  */
-#define DIRENT_LEN(name_len)                                                  \
-  ((DIRENT_NAME_OFFS + (name_len) + 1 + (DIRENT_ALIGN - 1))                   \
-   & ~(DIRENT_ALIGN - 1))
-
 /* Fetch a directory, as for netfs_get_dirents.  */
 static error_t
 get_dirents (struct pcifs_dirent *dir,
@@ -54,116 +44,157 @@ get_dirents (struct pcifs_dirent *dir,
 	     mach_msg_type_number_t * data_len,
 	     vm_size_t max_data_len, int *data_entries)
 {
-  struct pcifs_dirent *e;
-  error_t err = 0;
-  int i, count;
-  size_t size;
-  char *p;
+  error_t err;
+  struct pcifs_dir *d;
+  int count, lo, hi, mid;
+  size_t start, size;
+
+  if (dir->kind == FILE_KIND_ROM_DIR)
+    {
+      /* The images are only known once the ROM is read */
+      err = rom_images_load (dir);
+      if (err)
+	return err;
+    }
 
-  if (first_entry >= dir->dir->num_entries)
+  d = dir->dir;
+  if (first_entry >= d->num_entries)
     {
       *data_len = 0;
       *data_entries = 0;
       return 0;
     }
 
-  if (max_entries < 0)
-    count = dir->dir->num_entries;
-  else
+  count = d->num_entries - first_entry;
+  if (max_entries >= 0 && max_entries < count)
+    count = max_entries;
+
+  start = d->dirent_offs[first_entry];
+  if (max_data_len > 0
+      && d->dirent_offs[first_entry + count] - start > max_data_len)
     {
-      count = ((first_entry + max_entries) >= dir->dir->num_entries ?
-	       dir->dir->num_entries : max_entries) - first_entry;
+      /* Find how many entries fit */
+      lo = 0;
+      hi = count;
+      while (lo < hi)
+	{
+	  mid = lo + (hi - lo + 1) / 2;
+	  if (d->dirent_offs[first_entry + mid] - start <= max_data_len)
+	    lo = mid;
+	  else
+	    hi = mid - 1;
+	}
+      count = lo;
     }
 
-  size =
-    (count * DIRENTS_CHUNK_SIZE) >
-    max_data_len ? max_data_len : count * DIRENTS_CHUNK_SIZE;
-
-  *data = mmap (0, size, PROT_READ | PROT_WRITE, MAP_ANON, 0, 0);
-  err = ((void *) *data == (void *) -1) ? errno : 0;
-  if (err)
-    return err;
-
-  p = *data;
-  for (i = 0; i < count; i++)
+  size = d->dirent_offs[first_entry + count] - start;
+  if (size == 0)
     {
-      struct dirent hdr;
-      size_t name_len;
-      size_t sz;
-      int entry_type;
-
-      e = dir->dir->entries[i + first_entry];
-      name_len = strlen (e->name) + 1;
-      sz = DIRENT_LEN (name_len);
-      entry_type = IFTODT (e->stat.st_mode);
-
-      hdr.d_namlen = name_len;
-      hdr.d_fileno = e->stat.st_ino;
-      hdr.d_reclen = sz;
-      hdr.d_type = entry_type;
-
-      memcpy (p, &hdr, DIRENT_NAME_OFFS);
-      strncpy (p + DIRENT_NAME_OFFS, e->name, name_len);
-      p += sz;
+      *data_len = 0;
+      *data_entries = 0;
+      return 0;
     }
 
-  vm_address_t alloc_end = (vm_address_t) (*data + size);
-  vm_address_t real_end = round_page (p);
-  if (alloc_end > real_end)
-    munmap ((caddr_t) real_end, alloc_end - real_end);
-  *data_len = p - *data;
+  /* The listing is serialized already, just copy the range */
+  *data = mmap (0, size, PROT_READ | PROT_WRITE, MAP_ANON, 0, 0);
+  if ((void *) *data == MAP_FAILED)
+    return errno;
+  memcpy (*data, d->dirents + start, size);
+
+  *data_len = size;
   *data_entries = count;
 
-  return err;
+  return 0;
 }
 
 static struct pcifs_dirent *
 lookup (struct node *np, char *name)
 {
-  int i;
-  struct pcifs_dirent *ret = 0, *e;
-
-  for (i = 0; i < np->nn->ln->dir->num_entries; i++)
-    {
-      e = np->nn->ln->dir->entries[i];
-
-      if (!strncmp (e->name, name, NAME_SIZE))
-	{
-	  ret = e;
-	  break;
-	}
-    }
-
-  return ret;
+  return pcifs_dir_lookup (np->nn->ln->dir, name);
 }
 
+/*
+ * Protects `node' in all entries. The entry holds a light reference on its
+ * node, dropped in netfs_try_dropping_softrefs() once the last hard one is
+ * gone. A lookup upgrades that light reference to a hard one under this
+ * lock, so a node is never brought back once the entry has let it go.
+ */
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Create the node of `e', with a reference for the caller and a light one
+ * for the entry. Must be called with `node_lock' held.
+ */
 static error_t
 create_node (struct pcifs_dirent * e, struct node ** node)
 {
   struct node *np;
   struct netnode *nn;
 
-  np = netfs_make_node_alloc (sizeof (struct netnode));
+  np = node_pool_get ();
   if (!np)
     return ENOMEM;
-  np->nn_stat = e->stat;
+  entry_get_stat (e, &np->nn_stat);
   np->nn_translated = np->nn_stat.st_mode;
 
   nn = netfs_node_netnode (np);
   memset (nn, 0, sizeof (struct netnode));
   nn->ln = e;
 
+  netfs_nref_light (np);
   *node = e->node = np;
 
   return 0;
 }
 
+/* Get a reference to the node of `e', creating it if there's none */
+error_t
+entry_get_node (struct pcifs_dirent * e, struct node ** node)
+{
+  error_t err = 0;
+
+  pthread_mutex_lock (&node_lock);
+  if (e->node)
+    {
+      netfs_nref (e->node);
+      *node = e->node;
+    }
+  else
+    /* The new node is created with a reference. */
+    err = create_node (e, node);
+  pthread_mutex_unlock (&node_lock);
+
+  return err;
+}
+
+/*
+ * The last hard reference to `np' is gone, unlink it from its entry unless
+ * a lookup took a new one meanwhile. Called with `np' locked.
+ */
+void
+netfs_try_dropping_softrefs (struct node *np)
+{
+  struct pcifs_dirent *e = np->nn->ln;
+  int drop = 0;
+
+  pthread_mutex_lock (&node_lock);
+  if (e && e->node == np && refcounts_hard_references (&np->refcounts) == 0)
+    {
+      e->node = 0;
+      drop = 1;
+    }
+  pthread_mutex_unlock (&node_lock);
+
+  /* The caller still holds a light reference, this is never the last one */
+  if (drop)
+    netfs_nrele_light (np);
+}
+
 static void
 destroy_node (struct node *node)
 {
-  if (node->nn->ln)
-    node->nn->ln->node = 0;
-  free (node);
+  /* The entry let go of it already, no lookup can find it */
+  node_pool_put (node);
 }
 
 /* Attempt to create a file named NAME in DIR for USER with MODE.  Set *NODE
@@ -212,7 +243,10 @@ netfs_report_access (struct iouser * cred, struct node * node, int *types)
 error_t
 netfs_validate_stat (struct node * node, struct iouser * cred)
 {
-  /* Nothing to do here */
+  /* Compose the stat buffer from the entry's template */
+  etimes_fold (node->nn->ln);
+  entry_get_stat (node->nn->ln, &node->nn_stat);
+
   return 0;
 }
 
@@ -235,7 +269,7 @@ netfs_get_dirents (struct iouser * cred, struct node * dir,
   if (dir->nn->ln->dir)
     {
       err = get_dirents (dir->nn->ln, first_entry, max_entries,
-			 data, data_len, max_entries, data_entries);
+			 data, data_len, max_data_len, data_entries);
     }
   else
     err = ENOTDIR;
@@ -271,9 +305,12 @@ netfs_attempt_lookup (struct iouser * user, struct node * dir,
     {
       if (dir->nn->ln->parent)
 	{
-	  *node = dir->nn->ln->parent->node;
-	  pthread_mutex_lock (&(*node)->lock);
-	  netfs_nref (*node);
+	  /* The parent node may be gone, get it as any other */
+	  err = entry_get_node (dir->nn->ln->parent, node);
+	  if (!err)
+	    pthread_mutex_lock (&(*node)->lock);
+	  else
+	    *node = 0;
 	}
       else
 	{
@@ -293,6 +330,9 @@ netfs_attempt_lookup (struct iouser * user, struct node * dir,
 
       /* Check dir permissions */
       err = entry_check_perms (user, dir->nn->ln, O_READ | O_EXEC);
+      if (!err && dir->nn->ln->kind == FILE_KIND_ROM_DIR)
+	/* The images are only known once the ROM is read */
+	err = rom_images_load (dir->nn->ln);
       if (!err)
 	{
 	  entry = lookup (dir, name);
@@ -302,22 +342,9 @@ netfs_attempt_lookup (struct iouser * user, struct node * dir,
 	    }
 	  else
 	    {
-	      if (entry->node)
-		{
-		  netfs_nref (entry->node);
-		}
-	      else
-		{
-		  /*
-		   * No active node, create one.
-		   * The new node is created with a reference.
-		   */
-		  err = create_node (entry, node);
-		}
-
+	      err = entry_get_node (entry, node);
 	      if (!err)
 		{
-		  *node = entry->node;
 		  /* We have to unlock DIR's node before locking the child node
 		     because the locking order is always child-parent.  We know
 		     the child node won't go away because we already hold the
@@ -338,7 +365,7 @@ netfs_attempt_lookup (struct iouser * user, struct node * dir,
       *node = 0;
       pthread_mutex_unlock (&dir->lock);
     }
-  else
+  else if (!fs->params.pin_nodes)
     {
       /* Update the node cache */
       node_cache (*node);
@@ -495,33 +522,46 @@ netfs_attempt_read (struct iouser * cred, struct node * node,
 		    off_t offset, size_t * len, void *data)
 {
   error_t err;
+  struct pcifs_dirent *e;
 
-  if (!strncmp (node->nn->ln->name, FILE_CONFIG_NAME, NAME_SIZE))
-    {
-      err =
-	io_config_file (node->nn->ln->device, offset, len, data,
-			pci_sys->read);
-      if (!err)
-	/* Update atime */
-	UPDATE_TIMES (node->nn->ln, TOUCH_ATIME);
-    }
-  else if (!strncmp (node->nn->ln->name, FILE_ROM_NAME, NAME_SIZE))
-    {
-      err = read_rom_file (node->nn->ln->device, offset, len, data);
-      if (!err)
-	/* Update atime */
-	UPDATE_TIMES (node->nn->ln, TOUCH_ATIME);
-    }
-  else if (!strncmp
-	   (node->nn->ln->name, FILE_REGION_NAME, strlen (FILE_REGION_NAME)))
+  e = node->nn->ln;
+  switch (e->kind)
     {
-      err = io_region_file (node->nn->ln, offset, len, data, 1);
-      if (!err)
-	/* Update atime */
-	UPDATE_TIMES (node->nn->ln, TOUCH_ATIME);
+    case FILE_KIND_CONFIG:
+      err = io_config_file (e, offset, len, data, pci_sys->read);
+      break;
+    case FILE_KIND_ROM:
+      err = read_rom_file (e->device, offset, len, data);
+      break;
+    case FILE_KIND_ROM_IMAGE:
+      err = read_rom_image_file (e, offset, len, data);
+      break;
+    case FILE_KIND_CAPS:
+      err = read_caps_file (e->device, offset, len, data);
+      break;
+    case FILE_KIND_TOPOLOGY:
+      err = read_topology_file (e, offset, len, data);
+      break;
+    case FILE_KIND_STATS:
+      err = read_stats_file (e, offset, len, data);
+      break;
+    case FILE_KIND_MSIX_TABLE:
+    case FILE_KIND_MSIX_PBA:
+      err = io_msix_file (e, offset, len, data, 1);
+      break;
+    case FILE_KIND_REGION:
+      err = io_region_file (e, offset, len, data, 1);
+      break;
+    case FILE_KIND_FIFO:
+      err = io_fifo_file (e, offset, len, data, 1);
+      break;
+    default:
+      return EOPNOTSUPP;
     }
-  else
-    return EOPNOTSUPP;
+
+  if (!err)
+    /* Update atime */
+    UPDATE_TIMES (e, TOUCH_ATIME);
 
   return err;
 }
@@ -534,30 +574,103 @@ netfs_attempt_write (struct iouser * cred, struct node * node,
 		     off_t offset, size_t * len, void *data)
 {
   error_t err;
+  struct pcifs_dirent *e;
 
-  if (!strncmp (node->nn->ln->name, FILE_CONFIG_NAME, NAME_SIZE))
+  e = node->nn->ln;
+  switch (e->kind)
     {
-      err =
-	io_config_file (node->nn->ln->device, offset, len, data,
-			pci_sys->write);
-      if (!err)
-	{
-	  /* Update mtime and ctime */
-	  UPDATE_TIMES (node->nn->ln, TOUCH_MTIME | TOUCH_CTIME);
-	}
-    }
-  else if (!strncmp
-	   (node->nn->ln->name, FILE_REGION_NAME, strlen (FILE_REGION_NAME)))
-    {
-      err = io_region_file (node->nn->ln, offset, len, data, 0);
-      if (!err)
-	/* Update atime */
-	UPDATE_TIMES (node->nn->ln, TOUCH_MTIME | TOUCH_CTIME);
+    case FILE_KIND_CONFIG:
+      err = io_config_file (e, offset, len, data, pci_sys->write);
+      break;
+    case FILE_KIND_MSIX_TABLE:
+      err = io_msix_file (e, offset, len, data, 0);
+      break;
+    case FILE_KIND_REGION:
+      err = io_region_file (e, offset, len, data, 0);
+      break;
+    case FILE_KIND_FIFO:
+      err = io_fifo_file (e, offset, len, data, 0);
+      break;
+    default:
+      return EOPNOTSUPP;
     }
+
+  if (!err)
+    /* Update mtime and ctime */
+    UPDATE_TIMES (e, TOUCH_MTIME | TOUCH_CTIME);
+
+  return err;
+}
+
+/*
+ * Return memory objects for the file in USER, to be mapped by the client.
+ *
+ * Only memory regions and, when the backend allows it, the config file can
+ * be mapped. The latter is always read only. Permissions are checked here,
+ * once, and the client accesses the registers directly from then on.
+ */
+error_t
+netfs_S_io_map (struct protid * user,
+		mach_port_t * rdobj, mach_msg_type_name_t * rdobjtype,
+		mach_port_t * wrobj, mach_msg_type_name_t * wrobjtype)
+{
+  error_t err;
+  struct node *np;
+  vm_prot_t prot;
+  memory_object_t proxy;
+  int is_config;
+
+  if (!user)
+    return EOPNOTSUPP;
+
+  np = user->po->np;
+  if (np->nn->ln->kind == FILE_KIND_CONFIG)
+    is_config = 1;
+  else if (np->nn->ln->kind == FILE_KIND_REGION)
+    is_config = 0;
   else
     return EOPNOTSUPP;
 
-  return err;
+  prot = VM_PROT_NONE;
+  if (user->po->openstat & O_READ)
+    prot |= VM_PROT_READ;
+  if ((user->po->openstat & O_WRITE) && !is_config)
+    prot |= VM_PROT_WRITE;
+  if (prot == VM_PROT_NONE)
+    return EBADF;
+
+  /* Permissions may have changed since the file was opened */
+  err = entry_check_perms (user->user, np->nn->ln, user->po->openstat);
+  if (err)
+    return err;
+
+  pthread_mutex_lock (&np->lock);
+  if (is_config)
+    err = get_config_filemap (np->nn->ln, &proxy);
+  else
+    err = get_region_filemap (np->nn->ln, prot, &proxy);
+  pthread_mutex_unlock (&np->lock);
+  if (err)
+    return err;
+
+  *rdobj = *wrobj = MACH_PORT_NULL;
+  if (prot & VM_PROT_READ)
+    *rdobj = proxy;
+  if (prot & VM_PROT_WRITE)
+    {
+      if (*rdobj != MACH_PORT_NULL)
+	/* The same object is returned twice, add a send right */
+	mach_port_mod_refs (mach_task_self (), proxy, MACH_PORT_RIGHT_SEND,
+			    1);
+      *wrobj = proxy;
+    }
+
+  *rdobjtype = *wrobjtype = MACH_MSG_TYPE_MOVE_SEND;
+
+  /* Update atime */
+  UPDATE_TIMES (np->nn->ln, TOUCH_ATIME);
+
+  return 0;
 }
 
 /* Node NP is all done; free all its associated storage. */
@@ -36,8 +36,8 @@ struct netnode
   /* Light node */
   struct pcifs_dirent *ln;
 
-  /* Position in the node cache.  */
-  struct node *ncache_next, *ncache_prev;
 };
 
+error_t entry_get_node (struct pcifs_dirent *e, struct node **node);
+
 #endif /* NETFS_IMPL_H */
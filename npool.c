@@ -0,0 +1,167 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Node pool.
+ *
+ * There's never more than one node per directory entry, so a slab with one
+ * slot per entry holds all nodes the server will ever need. Nodes are taken
+ * from a free list and given back to it on their last release, so lookups
+ * don't go through malloc() and free().
+ *
+ * The slab is allocated at once but its pages are only touched as slots
+ * get used.
+ *
+ * A node only comes back here from netfs_node_norefs(), once its entry has
+ * dropped it under the lock lookups take, see entry_get_node(). No lookup
+ * can reach it through its old entry by then, so it's safe to reinitialize
+ * and hand it out for another one.
+ */
+
+#include <npool.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <hurd/fshelp.h>
+
+#include <pcifs.h>
+#include <netfs_impl.h>
+
+/* A free slot, linked through its first bytes */
+struct npool_slot
+{
+  struct npool_slot *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pool_base;
+static size_t pool_stride;
+static size_t pool_size;
+
+/* Slots never used yet start from here */
+static size_t pool_fresh;
+
+/* Slots given back */
+static struct npool_slot *pool_free;
+
+static size_t pool_used;
+static size_t pool_peak;
+
+/*
+ * Initialize a node in place, as netfs_make_node_alloc() does on the
+ * memory it allocates.
+ */
+static void
+pool_init_node (struct node *np)
+{
+  np->nn = netfs_node_netnode (np);
+  pthread_mutex_init (&np->lock, NULL);
+  refcounts_init (&np->refcounts, 1, 0);
+  np->sockaddr = MACH_PORT_NULL;
+  np->owner = 0;
+  fshelp_transbox_init (&np->transbox, &np->lock, np);
+  fshelp_lock_init (&np->userlock);
+}
+
+/* Create the slab, with room for `size' nodes */
+error_t
+node_pool_init (size_t size)
+{
+  size_t align = __alignof__ (long double);
+
+  pool_stride = netfs_node_size (sizeof (struct netnode));
+  pool_stride = (pool_stride + align - 1) & ~(align - 1);
+
+  pool_base = calloc (size, pool_stride);
+  if (!pool_base)
+    return ENOMEM;
+  pool_size = size;
+
+  return 0;
+}
+
+/*
+ * Get a node with room for a netnode and one reference. Fall back to
+ * netfs_make_node_alloc() if the pool is empty.
+ */
+struct node *
+node_pool_get (void)
+{
+  struct npool_slot *slot = 0;
+  struct node *np;
+
+  pthread_mutex_lock (&pool_lock);
+  if (pool_free)
+    {
+      slot = pool_free;
+      pool_free = slot->next;
+    }
+  else if (pool_fresh < pool_size)
+    slot = (struct npool_slot *) (pool_base + pool_fresh++ * pool_stride);
+  if (slot)
+    {
+      pool_used++;
+      if (pool_used > pool_peak)
+	pool_peak = pool_used;
+    }
+  pthread_mutex_unlock (&pool_lock);
+
+  if (!slot)
+    return netfs_make_node_alloc (sizeof (struct netnode));
+
+  np = (struct node *) slot;
+  pool_init_node (np);
+
+  return np;
+}
+
+/* Give `np' back, it's freed if it isn't from the pool */
+void
+node_pool_put (struct node *np)
+{
+  struct npool_slot *slot = (struct npool_slot *) np;
+
+  /* Its entry must have let it go already */
+  assert_backtrace (!np->nn->ln || np->nn->ln->node != np);
+
+  if ((char *) np < pool_base
+      || (char *) np >= pool_base + pool_size * pool_stride)
+    {
+      free (np);
+      return;
+    }
+
+  pthread_mutex_lock (&pool_lock);
+  slot->next = pool_free;
+  pool_free = slot;
+  pool_used--;
+  pthread_mutex_unlock (&pool_lock);
+}
+
+void
+node_pool_stats (struct npool_stats *stats)
+{
+  pthread_mutex_lock (&pool_lock);
+  stats->size = pool_size;
+  stats->used = pool_used;
+  stats->peak = pool_peak;
+  pthread_mutex_unlock (&pool_lock);
+}
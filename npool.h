@@ -0,0 +1,41 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Header for the node pool */
+
+#ifndef NPOOL_H
+#define NPOOL_H
+
+#include <stddef.h>
+#include <hurd/netfs.h>
+
+/* Occupancy of the pool */
+struct npool_stats
+{
+  size_t size;			/* Nodes the pool can hold */
+  size_t used;			/* Nodes in use now */
+  size_t peak;			/* Most nodes in use at once */
+};
+
+error_t node_pool_init (size_t size);
+struct node *node_pool_get (void);
+void node_pool_put (struct node *np);
+void node_pool_stats (struct npool_stats *stats);
+
+#endif /* NPOOL_H */
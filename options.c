@@ -24,11 +24,13 @@
 #include <options.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <argp.h>
 #include <argz.h>
 #include <error.h>
 
 #include <pcifs.h>
+#include <pci_map.h>
 
 /* Fsysopts and command line option parsing */
 
@@ -153,6 +155,17 @@ parse_opt (int opt, char *arg, struct argp_state *state)
     case 'n':
       h->ncache_len = atoi (arg);
       break;
+    case 'm':
+      h->map_budget = strtoul (arg, 0, 10);
+      if (h->map_budget > SIZE_MAX / (1024 * 1024))
+	PERR (EINVAL, "Mapping budget too large: %s", arg);
+      break;
+    case 'p':
+      h->pin_nodes = 1;
+      break;
+    case 'r':
+      h->relatime = atoi (arg);
+      break;
     case ARGP_KEY_INIT:
       /* Initialize our parsing state.  */
       h = malloc (sizeof (struct parse_hook));
@@ -162,6 +175,10 @@ parse_opt (int opt, char *arg, struct argp_state *state)
       h->permsets = 0;
       h->num_permsets = 0;
       h->ncache_len = NODE_CACHE_MAX;
+      /* Keep the current budget unless the option is given */
+      h->map_budget = pci_map_get_budget () / (1024 * 1024);
+      h->pin_nodes = 0;
+      h->relatime = 0;
       err = parse_hook_add_set (h);
       if (err)
 	FAIL (err, 1, err, "option parsing");
@@ -198,6 +215,16 @@ parse_opt (int opt, char *arg, struct argp_state *state)
       /* Set cache len */
       fs->params.node_cache_max = h->ncache_len;
 
+      /* Set the mapping budget */
+      pci_map_set_budget (h->map_budget * (size_t) (1024 * 1024));
+
+      /* Set the time update mode */
+      fs->params.relatime = h->relatime;
+
+      /* Pinning is done once the tree exists */
+      if (!fs->root)
+	fs->params.pin_nodes = h->pin_nodes;
+
       if (fs->root)
 	{
 	  /*
@@ -212,6 +239,14 @@ parse_opt (int opt, char *arg, struct argp_state *state)
 
 	  err = fs_set_permissions (fs);
 
+	  /* Pinned nodes are never released, so only enable it */
+	  if (!err && h->pin_nodes && !fs->params.pin_nodes)
+	    {
+	      err = fs_pin_nodes (fs);
+	      if (!err)
+		fs->params.pin_nodes = 1;
+	    }
+
 	  /* Accept RPCs again */
 	  ports_resume_all_rpcs ();
 	}
@@ -271,7 +306,16 @@ netfs_append_args (char **argz, size_t * argz_len)
     }
 
   if (fs->params.node_cache_max != NODE_CACHE_MAX)
-    ADD_OPT ("--ncache=%u", fs->params.node_cache_max);
+    ADD_OPT ("--ncache=%zu", fs->params.node_cache_max);
+
+  if (pci_map_get_budget () != PCI_MAP_BUDGET_DEFAULT * 1024 * 1024)
+    ADD_OPT ("--map-budget=%zu", pci_map_get_budget () / (1024 * 1024));
+
+  if (fs->params.pin_nodes)
+    ADD_OPT ("--pin");
+
+  if (fs->params.relatime)
+    ADD_OPT ("--relatime=%u", fs->params.relatime);
 
 #undef ADD_OPT
   return err;
@@ -29,6 +29,7 @@
 #include <argp.h>
 
 #include <pcifs.h>
+#include <pci_map.h>
 
 #define STR2(x)  #x
 #define STR(x)  STR2(x)
@@ -45,6 +46,15 @@ struct parse_hook
 
   /* Node cache length */
   size_t ncache_len;
+
+  /* Mapping budget, in MiB */
+  size_t map_budget;
+
+  /* Whether to pin all nodes */
+  int pin_nodes;
+
+  /* Access time interval, zero when off */
+  unsigned int relatime;
 };
 
 /* Lwip translator options.  Used for both startup and runtime.  */
@@ -62,7 +72,16 @@ static const struct argp_option options[] = {
   {"gid", 'G', "GID", 0, "Group ID to give permissions to"},
   {0, 0, 0, 0, "Global configuration options:", 3},
   {"ncache", 'n', "LENGTH", 0,
-   "Node cache length. " STR (NODE_CACHE_MAX) " by default"},
+   "Maximum node cache length, it grows up to it as needed. "
+   STR (NODE_CACHE_MAX) " by default"},
+  {"map-budget", 'm', "MIB", 0,
+   "Virtual memory used to map device memory, in MiB. "
+   STR (PCI_MAP_BUDGET_DEFAULT) " by default"},
+  {"pin", 'p', 0, 0,
+   "Create all nodes at startup and keep them for the life of the server"},
+  {"relatime", 'r', "SECONDS", 0,
+   "Update access times at most once every SECONDS, and other times only "
+   "when stat'ed. Off by default"},
   {0}
 };
 
@@ -21,6 +21,7 @@
 
 #include <pci_S.h>
 
+#include <stdio.h>
 #include <fcntl.h>
 #include <hurd/netfs.h>
 #include <sys/mman.h>
@@ -28,6 +29,8 @@
 #include <pci_access.h>
 #include <pcifs.h>
 #include <func_files.h>
+#include <pci_index.h>
+#include <ncache.h>
 
 static error_t
 check_permissions (struct protid *master, int flags)
@@ -62,7 +65,7 @@ calculate_ndevs (struct iouser *user)
   for (i = 0, e = fs->entries; i < fs->num_entries; i++, e++)
     {
       if (e->func < 0		/* Skip entries without a full address  */
-	  || !S_ISDIR (e->stat.st_mode))	/* and entries that are not folders     */
+	  || e->kind != FILE_KIND_DIR)	/* and entries that are not folders     */
 	continue;
 
       if (!entry_check_perms (user, e, O_READ))
@@ -90,7 +93,7 @@ S_pci_conf_read (struct protid * master, int reg, char **data,
     return EOPNOTSUPP;
 
   e = master->po->np->nn->ln;
-  if (strncmp (e->name, FILE_CONFIG_NAME, NAME_SIZE))
+  if (e->kind != FILE_KIND_CONFIG)
     /* This operation may only be addressed to the config file */
     return EINVAL;
 
@@ -138,7 +141,7 @@ S_pci_conf_write (struct protid * master, int reg, char *data, size_t datalen,
     return EOPNOTSUPP;
 
   e = master->po->np->nn->ln;
-  if (strncmp (e->name, FILE_CONFIG_NAME, NAME_SIZE))
+  if (e->kind != FILE_KIND_CONFIG)
     /* This operation may only be addressed to the config file */
     return EINVAL;
 
@@ -150,6 +153,8 @@ S_pci_conf_write (struct protid * master, int reg, char *data, size_t datalen,
 
   pthread_mutex_lock (lock);
   err = pci_sys->write (e->bus, e->dev, e->func, reg, data, datalen);
+  if (!err)
+    err = config_write_snoop (e->parent, reg, datalen, data);
   pthread_mutex_unlock (lock);
 
   if (!err)
@@ -192,7 +197,7 @@ S_pci_get_dev_regions (struct protid * master, char **data, size_t * datalen)
     return EOPNOTSUPP;
 
   e = master->po->np->nn->ln;
-  if (strncmp (e->name, FILE_CONFIG_NAME, NAME_SIZE))
+  if (e->kind != FILE_KIND_CONFIG)
     /* This operation may only be addressed to the config file */
     return EINVAL;
 
@@ -242,7 +247,7 @@ S_pci_get_dev_rom (struct protid * master, char **data, size_t * datalen)
     return EOPNOTSUPP;
 
   e = master->po->np->nn->ln;
-  if (strncmp (e->name, FILE_CONFIG_NAME, NAME_SIZE))
+  if (e->kind != FILE_KIND_CONFIG)
     /* This operation may only be addressed to the config file */
     return EINVAL;
 
@@ -271,3 +276,343 @@ S_pci_get_dev_rom (struct protid * master, char **data, size_t * datalen)
 
   return 0;
 }
+
+/*
+ * Return in `data' the offsets of all capabilities with ID `id' in the
+ * given device. Extended capabilities are looked up if `ext' is true.
+ */
+error_t
+S_pci_find_cap (struct protid * master, int id, int ext, char **data,
+		size_t * datalen)
+{
+  error_t err;
+  struct pcifs_dirent *e;
+  struct pci_cap *cap;
+  uint16_t *offsets;
+  size_t count, size;
+  int i;
+
+  if (!master)
+    return EOPNOTSUPP;
+
+  e = master->po->np->nn->ln;
+  if (e->kind != FILE_KIND_CONFIG)
+    /* This operation may only be addressed to the config file */
+    return EINVAL;
+
+  err = check_permissions (master, O_READ);
+  if (err)
+    return err;
+
+  cap = pci_device_find_cap (e->device, id, ext, &count);
+  if (!cap)
+    return ENODEV;
+
+  /* Allocate memory if needed */
+  size = count * sizeof (uint16_t);
+  if (size > *datalen)
+    {
+      *data = mmap (0, size, PROT_READ | PROT_WRITE, MAP_ANON, 0, 0);
+      if (*data == MAP_FAILED)
+	return ENOMEM;
+    }
+
+  /* Copy the offsets */
+  for (i = 0, offsets = (uint16_t *) * data; i < count; i++)
+    offsets[i] = cap[i].offset;
+
+  /* Update atime */
+  UPDATE_TIMES (e, TOUCH_ATIME);
+
+  *datalen = size;
+
+  return 0;
+}
+
+/*
+ * Execute the batch of register accesses in `ops' on the regions of the
+ * function this is addressed to, and return the completed operations in
+ * `data'.
+ */
+error_t
+S_pci_submit (struct protid * master, char *ops, size_t opslen, char **data,
+	      size_t * datalen)
+{
+  error_t err;
+  struct pcifs_dirent *e, *file;
+  struct pci_reg_op *batch;
+  size_t nops, done, i;
+  int flags, region_flags[6] = { 0 };
+
+  if (!master)
+    return EOPNOTSUPP;
+
+  e = master->po->np->nn->ln;
+  if (!e->device || e->kind != FILE_KIND_DIR)
+    /* This operation may only be addressed to a function directory */
+    return EINVAL;
+
+  if (opslen % sizeof (struct pci_reg_op))
+    return EINVAL;
+  nops = opslen / sizeof (struct pci_reg_op);
+
+  err = check_permissions (master, O_READ);
+  if (err)
+    return err;
+
+  /*
+   * Each op needs the same access to its region file a read or write on it
+   * would. Ops on regions out of range fail on their own.
+   */
+  flags = 0;
+  for (i = 0, batch = (struct pci_reg_op *) ops; i < nops; i++)
+    if (batch[i].region < 6)
+      {
+	region_flags[batch[i].region] |= O_READ;
+	if (batch[i].op != PCI_REG_OP_READ)
+	  region_flags[batch[i].region] |= O_WRITE;
+	flags |= region_flags[batch[i].region];
+      }
+
+  for (i = 0; i < e->dir->num_entries; i++)
+    {
+      file = e->dir->entries[i];
+      if (file->kind != FILE_KIND_REGION || !region_flags[file->index])
+	continue;
+
+      err = entry_check_perms (master->user, file, region_flags[file->index]);
+      if (err)
+	return err;
+    }
+
+  /* Allocate memory if needed */
+  if (opslen > *datalen)
+    {
+      *data = mmap (0, opslen, PROT_READ | PROT_WRITE, MAP_ANON, 0, 0);
+      if (*data == MAP_FAILED)
+	return ENOMEM;
+    }
+
+  /* Completions are written over a copy of the batch */
+  memcpy (*data, ops, opslen);
+  batch = (struct pci_reg_op *) * data;
+  exec_reg_ops (e, batch, nops, &done);
+
+  if (flags & O_WRITE)
+    /* Update mtime and ctime */
+    UPDATE_TIMES (e, TOUCH_MTIME | TOUCH_CTIME);
+  else
+    /* Update atime */
+    UPDATE_TIMES (e, TOUCH_ATIME);
+
+  *datalen = done * sizeof (struct pci_reg_op);
+
+  return 0;
+}
+
+/*
+ * Find the device resource owning address `addr' in `space', memory or I/O.
+ * Only the root node answers this.
+ */
+error_t
+S_pci_lookup_addr (struct protid * master, int space, uint64_t addr,
+		   char **data, size_t * datalen)
+{
+  error_t err;
+  struct pcifs_dirent *e;
+  struct pci_addr_owner owner;
+
+  if (!master)
+    return EOPNOTSUPP;
+
+  e = master->po->np->nn->ln;
+  if (e != fs->entries)
+    /* This operation may only be addressed to the root node */
+    return EINVAL;
+
+  err = entry_check_perms (master->user, e, O_READ);
+  if (err)
+    return err;
+
+  err = pci_index_lookup (space, addr, &owner);
+  if (err)
+    return err;
+
+  /* Allocate memory if needed */
+  if (sizeof (owner) > *datalen)
+    {
+      *data = mmap (0, sizeof (owner), PROT_READ | PROT_WRITE, MAP_ANON, 0,
+		    0);
+      if (*data == MAP_FAILED)
+	return ENOMEM;
+    }
+
+  memcpy (*data, &owner, sizeof (owner));
+  *datalen = sizeof (owner);
+
+  return 0;
+}
+
+/* Open `e' for `master's user, and return the new protid in `newpi' */
+static error_t
+open_entry (struct protid *master, struct pcifs_dirent *e, int flags,
+	    struct protid **newpi)
+{
+  error_t err;
+  struct node *np;
+  struct iouser *user;
+
+  err = entry_get_node (e, &np);
+  if (err)
+    return err;
+  pthread_mutex_lock (&np->lock);
+
+  err = netfs_check_open_permissions (master->user, np, flags, 0);
+  if (!err)
+    err = iohelp_dup_iouser (&user, master->user);
+  if (!err)
+    {
+      *newpi =
+	netfs_make_protid (netfs_make_peropen (np, flags, master->po), user);
+      if (!*newpi)
+	{
+	  err = errno;
+	  iohelp_free_iouser (user);
+	}
+    }
+
+  if (!err && !fs->params.pin_nodes)
+    node_cache (np);
+  netfs_nput (np);
+
+  return err;
+}
+
+/*
+ * Find `name' in directory `*dir' for `user', checking search permission on
+ * it as a path lookup does, and set `*dir' to it. It must be a directory.
+ */
+static error_t
+open_dev_lookup (struct iouser *user, struct pcifs_dirent **dir,
+		 const char *name)
+{
+  error_t err;
+
+  err = entry_check_perms (user, *dir, O_READ | O_EXEC);
+  if (err)
+    return err;
+
+  *dir = (*dir)->dir ? pcifs_dir_lookup ((*dir)->dir, name) : 0;
+  if (!*dir || !(*dir)->dir)
+    return ENOENT;
+
+  return 0;
+}
+
+/*
+ * Open the config, region and rom files of function `domain:bus:dev.func'
+ * in one go, without walking the tree. Only the root node answers this.
+ *
+ * `ports' gets PCI_OPEN_DEV_PORTS ports, in the order config, regions 0 to
+ * 5 and rom, null for files the function doesn't have. The rom is read
+ * only, so it's opened for reading if `flags' asks for it, and left null
+ * otherwise.
+ */
+error_t
+S_pci_open_dev (struct protid * master, int domain, int bus, int dev,
+		int func, int flags, mach_port_t ** ports,
+		mach_msg_type_number_t * portsCnt)
+{
+  error_t err;
+  struct pcifs_dirent *e, *dir, *file;
+  struct protid *newpi[PCI_OPEN_DEV_PORTS] = { 0 };
+  char name[NAME_SIZE];
+  int i, j;
+
+  if (!master)
+    return EOPNOTSUPP;
+
+  e = master->po->np->nn->ln;
+  if (e != fs->entries)
+    /* This operation may only be addressed to the root node */
+    return EINVAL;
+
+  flags &= O_READ | O_WRITE;
+  if (!flags)
+    return EINVAL;
+
+  /* Find the function, checking every directory on the way */
+  dir = e;
+  snprintf (name, NAME_SIZE, "%04x", domain);
+  err = open_dev_lookup (master->user, &dir, name);
+  if (!err)
+    {
+      snprintf (name, NAME_SIZE, "%02x", bus);
+      err = open_dev_lookup (master->user, &dir, name);
+    }
+  if (!err)
+    {
+      snprintf (name, NAME_SIZE, "%02x", dev);
+      err = open_dev_lookup (master->user, &dir, name);
+    }
+  if (!err)
+    {
+      snprintf (name, NAME_SIZE, "%01u", func);
+      err = open_dev_lookup (master->user, &dir, name);
+    }
+  if (!err)
+    err = entry_check_perms (master->user, dir, O_READ | O_EXEC);
+  if (err)
+    return err;
+
+  for (i = 0; i < dir->dir->num_entries && !err; i++)
+    {
+      file = dir->dir->entries[i];
+      switch (file->kind)
+	{
+	case FILE_KIND_CONFIG:
+	  j = PCI_OPEN_DEV_CONFIG;
+	  break;
+	case FILE_KIND_REGION:
+	  j = PCI_OPEN_DEV_REGION (file->index);
+	  break;
+	case FILE_KIND_ROM:
+	  if (!(flags & O_READ))
+	    continue;
+	  j = PCI_OPEN_DEV_ROM;
+	  break;
+	default:
+	  continue;
+	}
+
+      err = open_entry (master, file,
+			j == PCI_OPEN_DEV_ROM ? flags & O_READ : flags,
+			&newpi[j]);
+    }
+
+  /* Allocate memory if needed */
+  if (!err && PCI_OPEN_DEV_PORTS > *portsCnt)
+    {
+      *ports = mmap (0, PCI_OPEN_DEV_PORTS * sizeof (mach_port_t),
+		     PROT_READ | PROT_WRITE, MAP_ANON, 0, 0);
+      if (*ports == MAP_FAILED)
+	err = ENOMEM;
+    }
+
+  for (i = 0; i < PCI_OPEN_DEV_PORTS; i++)
+    {
+      if (!err)
+	(*ports)[i] = newpi[i] ? ports_get_right (newpi[i]) : MACH_PORT_NULL;
+      else if (newpi[i])
+	/* Drop what was opened */
+	ports_destroy_right (newpi[i]);
+      if (newpi[i])
+	ports_port_deref (newpi[i]);
+    }
+  if (err)
+    return err;
+
+  *portsCnt = PCI_OPEN_DEV_PORTS;
+
+  return 0;
+}
@@ -32,9 +32,68 @@
 #include <pci_access.h>
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <x86_pci.h>
 
+#define PCI_STATUS		0x06
+#define PCI_STATUS_CAP_LIST	0x10
+#define PCI_HDRTYPE		0x0E
+#define PCI_HDRTYPE_CARDBUS	0x02
+#define PCI_CAP_PTR		0x34
+#define PCI_CB_CAP_PTR		0x14
+
+#define PCI_EXT_CAP_ID(hdr)	((hdr) & 0xFFFF)
+#define PCI_EXT_CAP_NEXT(hdr)	(((hdr) >> 20) & 0xFFC)
+
+/* MSI-X capability registers */
+#define PCI_MSIX_FLAGS		0x02
+#define PCI_MSIX_FLAGS_QSIZE	0x07FF
+#define PCI_MSIX_TABLE		0x04
+#define PCI_MSIX_PBA		0x08
+#define PCI_MSIX_BIR		0x07
+
+/* Bridge window registers */
+#define PCI_IO_BASE		0x1C
+#define PCI_IO_LIMIT		0x1D
+#define PCI_IO_32		0x01
+#define PCI_MEMORY_BASE		0x20
+#define PCI_MEMORY_LIMIT	0x22
+#define PCI_PREF_MEMORY_BASE	0x24
+#define PCI_PREF_MEMORY_LIMIT	0x26
+#define PCI_PREF_64		0x01
+#define PCI_PREF_BASE_UPPER32	0x28
+#define PCI_PREF_LIMIT_UPPER32	0x2C
+#define PCI_IO_BASE_UPPER16	0x30
+#define PCI_IO_LIMIT_UPPER16	0x32
+
+/* Expansion ROM image headers */
+#define PCI_ROM_SIGNATURE	0xAA55
+#define PCI_ROM_PCIR_PTR	0x18
+#define PCI_ROM_HEADER_SIZE	0x1A
+#define PCI_PCIR_SIGNATURE	0x52494350	/* "PCIR" */
+#define PCI_PCIR_LENGTH		0x10
+#define PCI_PCIR_CODE_TYPE	0x14
+#define PCI_PCIR_INDICATOR	0x15
+#define PCI_PCIR_LAST_IMAGE	0x80
+#define PCI_PCIR_SIZE		0x18
+#define PCI_ROM_IMAGE_UNIT	512
+
+/* PCI Express capability registers */
+#define PCI_EXP_FLAGS		0x02
+#define PCI_EXP_FLAGS_TYPE(reg)	(((reg) >> 4) & 0xF)
+#define PCI_EXP_LNKCAP		0x0C
+#define PCI_EXP_LNKSTA		0x12
+#define PCI_EXP_LNK_SPEED(reg)	((reg) & 0xF)
+#define PCI_EXP_LNK_WIDTH(reg)	(((reg) >> 4) & 0x3F)
+
+/* Each standard capability takes at least 4 bytes after the header */
+#define PCI_CAP_MAX_TTL		48
+
+/* Sort key for capabilities: list first, then ID */
+#define PCI_CAP_KEY(id, ext)	(((uint32_t) !!(ext) << 16) | (id))
+
 /* Configure PCI parameters */
 int
 pci_system_init (void)
@@ -49,3 +108,434 @@ pci_system_init (void)
 
   return err;
 }
+
+static int
+cap_cmp (const void *a, const void *b)
+{
+  const struct pci_cap *ca = a, *cb = b;
+  uint32_t ka, kb;
+
+  ka = PCI_CAP_KEY (ca->id, ca->offset >= PCI_EXT_CAP_START);
+  kb = PCI_CAP_KEY (cb->id, cb->offset >= PCI_EXT_CAP_START);
+  if (ka != kb)
+    return ka < kb ? -1 : 1;
+
+  return (int) ca->offset - (int) cb->offset;
+}
+
+static error_t
+add_cap (struct pci_device *dev, uint16_t id, uint16_t offset)
+{
+  struct pci_cap *caps;
+
+  caps = realloc (dev->caps, (dev->num_caps + 1) * sizeof (struct pci_cap));
+  if (!caps)
+    return ENOMEM;
+
+  caps[dev->num_caps].id = id;
+  caps[dev->num_caps].offset = offset;
+  dev->caps = caps;
+  dev->num_caps++;
+
+  return 0;
+}
+
+/*
+ * Walk the standard and extended capability lists of `dev' once and store
+ * them, sorted, for later lookups.
+ */
+error_t
+pci_device_parse_caps (struct pci_device *dev)
+{
+  error_t err;
+  uint16_t status;
+  uint8_t hdrtype, ptr, hdr[2];
+  uint32_t ext_hdr;
+  uint16_t offset;
+  int ttl;
+
+  free (dev->caps);
+  dev->caps = 0;
+  dev->num_caps = 0;
+
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_STATUS, &status,
+		       sizeof (status));
+  if (err)
+    return err;
+
+  if (status & PCI_STATUS_CAP_LIST)
+    {
+      err =
+	pci_sys->read (dev->bus, dev->dev, dev->func, PCI_HDRTYPE, &hdrtype,
+		       sizeof (hdrtype));
+      if (err)
+	return err;
+
+      err = pci_sys->read (dev->bus, dev->dev, dev->func,
+			   (hdrtype & 0x3) == PCI_HDRTYPE_CARDBUS ?
+			   PCI_CB_CAP_PTR : PCI_CAP_PTR, &ptr, sizeof (ptr));
+      if (err)
+	return err;
+
+      for (ttl = PCI_CAP_MAX_TTL; ptr >= 0x40 && ttl > 0; ttl--)
+	{
+	  /* The lower two bits are reserved */
+	  ptr &= ~0x3;
+
+	  /* ID and next pointer */
+	  err = pci_sys->read (dev->bus, dev->dev, dev->func, ptr, hdr,
+			       sizeof (hdr));
+	  if (err)
+	    return err;
+
+	  if (hdr[0] == 0xFF)
+	    break;
+
+	  err = add_cap (dev, hdr[0], ptr);
+	  if (err)
+	    return err;
+
+	  ptr = hdr[1];
+	}
+    }
+
+  /* Extended capabilities are only reachable with a PCIe sized space */
+  if (dev->config_size > PCI_EXT_CAP_START)
+    {
+      ttl = (dev->config_size - PCI_EXT_CAP_START) / 4;
+      for (offset = PCI_EXT_CAP_START; offset && ttl > 0; ttl--)
+	{
+	  err = pci_sys->read (dev->bus, dev->dev, dev->func, offset,
+			       &ext_hdr, sizeof (ext_hdr));
+	  if (err)
+	    return err;
+
+	  if (ext_hdr == 0 || ext_hdr == 0xFFFFFFFF)
+	    break;
+
+	  err = add_cap (dev, PCI_EXT_CAP_ID (ext_hdr), offset);
+	  if (err)
+	    return err;
+
+	  offset = PCI_EXT_CAP_NEXT (ext_hdr);
+	  if (offset < PCI_EXT_CAP_START)
+	    break;
+	}
+    }
+
+  qsort (dev->caps, dev->num_caps, sizeof (struct pci_cap), cap_cmp);
+
+  return 0;
+}
+
+/*
+ * Find the capabilities with ID `id' in the standard list, or in the
+ * extended one if `ext' is true.
+ *
+ * Return a pointer to the first one and their number in `*count', or null
+ * if the device has no such capability.
+ */
+struct pci_cap *
+pci_device_find_cap (struct pci_device *dev, uint16_t id, int ext,
+		     size_t * count)
+{
+  size_t lo, hi, mid, n;
+  uint32_t key, mid_key;
+
+  /* Lower bound */
+  key = PCI_CAP_KEY (id, ext);
+  lo = 0;
+  hi = dev->num_caps;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      mid_key = PCI_CAP_KEY (dev->caps[mid].id,
+			     dev->caps[mid].offset >= PCI_EXT_CAP_START);
+      if (mid_key < key)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  for (n = 0; lo + n < dev->num_caps; n++)
+    if (PCI_CAP_KEY (dev->caps[lo + n].id,
+		     dev->caps[lo + n].offset >= PCI_EXT_CAP_START) != key)
+      break;
+
+  if (count)
+    *count = n;
+
+  return n ? &dev->caps[lo] : 0;
+}
+
+/* Whether [`offset', `offset' + `size') lies in a memory BAR of `dev' */
+static int
+msix_bar_valid (struct pci_device *dev, uint8_t bar, uint32_t offset,
+		size_t size)
+{
+  return bar < 6 && !dev->regions[bar].is_IO
+    && (pciaddr_t) offset + size <= dev->regions[bar].size;
+}
+
+/*
+ * Locate the MSI-X table and PBA of `dev', if it supports MSI-X.
+ *
+ * The capability index must be built already.
+ */
+error_t
+pci_device_parse_msix (struct pci_device *dev)
+{
+  error_t err;
+  struct pci_cap *cap;
+  struct pci_msix msix;
+  uint16_t flags;
+  uint32_t table, pba;
+
+  memset (&dev->msix, 0, sizeof (dev->msix));
+
+  cap = pci_device_find_cap (dev, PCI_CAP_ID_MSIX, 0, 0);
+  if (!cap)
+    return 0;
+
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       cap->offset + PCI_MSIX_FLAGS, &flags, sizeof (flags));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       cap->offset + PCI_MSIX_TABLE, &table, sizeof (table));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       cap->offset + PCI_MSIX_PBA, &pba, sizeof (pba));
+  if (err)
+    return err;
+
+  msix.table_size = (flags & PCI_MSIX_FLAGS_QSIZE) + 1;
+  msix.table_bar = table & PCI_MSIX_BIR;
+  msix.table_offset = table & ~PCI_MSIX_BIR;
+  msix.pba_bar = pba & PCI_MSIX_BIR;
+  msix.pba_offset = pba & ~PCI_MSIX_BIR;
+
+  /* Ignore broken capabilities pointing out of their BARs */
+  if (msix_bar_valid (dev, msix.table_bar, msix.table_offset,
+		      PCI_MSIX_TABLE_BYTES (&msix))
+      && msix_bar_valid (dev, msix.pba_bar, msix.pba_offset,
+			 PCI_MSIX_PBA_BYTES (&msix)))
+    dev->msix = msix;
+
+  return 0;
+}
+
+/* Read the negotiated speed and width of the link of `dev' */
+error_t
+pci_device_refresh_link (struct pci_device *dev)
+{
+  error_t err;
+  uint16_t status;
+
+  if (!dev->link.cap)
+    return 0;
+
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       dev->link.cap + PCI_EXP_LNKSTA, &status,
+		       sizeof (status));
+  if (err)
+    return err;
+
+  dev->link.speed = PCI_EXP_LNK_SPEED (status);
+  dev->link.width = PCI_EXP_LNK_WIDTH (status);
+
+  return 0;
+}
+
+/*
+ * Read the link capabilities and status of `dev', if it's a PCI Express
+ * device.
+ *
+ * The capability index must be built already.
+ */
+error_t
+pci_device_parse_link (struct pci_device *dev)
+{
+  error_t err;
+  struct pci_cap *cap;
+  uint16_t flags;
+  uint32_t lnkcap;
+
+  memset (&dev->link, 0, sizeof (dev->link));
+
+  cap = pci_device_find_cap (dev, PCI_CAP_ID_EXP, 0, 0);
+  if (!cap)
+    return 0;
+
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       cap->offset + PCI_EXP_FLAGS, &flags, sizeof (flags));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func,
+		       cap->offset + PCI_EXP_LNKCAP, &lnkcap,
+		       sizeof (lnkcap));
+  if (err)
+    return err;
+
+  dev->link.cap = cap->offset;
+  dev->link.port_type = PCI_EXP_FLAGS_TYPE (flags);
+  dev->link.max_speed = PCI_EXP_LNK_SPEED (lnkcap);
+  dev->link.max_width = PCI_EXP_LNK_WIDTH (lnkcap);
+
+  return pci_device_refresh_link (dev);
+}
+
+/*
+ * Find the images in the expansion ROM of `dev', already copied in memory.
+ *
+ * Parsing stops at the first invalid header or at the one marked as the last
+ * image.
+ */
+error_t
+pci_device_parse_rom (struct pci_device *dev)
+{
+  struct pci_rom_image images[PCI_ROM_MAX_IMAGES];
+  uint8_t *rom, *header, *pcir;
+  uint16_t signature, pcir_ptr, length;
+  uint32_t pcir_signature;
+  size_t offset, rom_size;
+  int i;
+
+  free (dev->rom_images);
+  dev->rom_images = 0;
+  dev->num_rom_images = 0;
+
+  rom = dev->rom_shadow;
+  rom_size = dev->rom_shadow_size;
+  if (!rom)
+    return 0;
+
+  offset = 0;
+  for (i = 0; i < PCI_ROM_MAX_IMAGES; i++)
+    {
+      if (offset + PCI_ROM_HEADER_SIZE > rom_size)
+	break;
+
+      header = rom + offset;
+      memcpy (&signature, header, sizeof (signature));
+      memcpy (&pcir_ptr, header + PCI_ROM_PCIR_PTR, sizeof (pcir_ptr));
+      if (signature != PCI_ROM_SIGNATURE
+	  || offset + pcir_ptr + PCI_PCIR_SIZE > rom_size)
+	break;
+
+      pcir = rom + offset + pcir_ptr;
+      memcpy (&pcir_signature, pcir, sizeof (pcir_signature));
+      memcpy (&length, pcir + PCI_PCIR_LENGTH, sizeof (length));
+      if (pcir_signature != PCI_PCIR_SIGNATURE || length == 0)
+	break;
+
+      images[i].offset = offset;
+      images[i].size = length * PCI_ROM_IMAGE_UNIT;
+      images[i].code_type = pcir[PCI_PCIR_CODE_TYPE];
+
+      /* Clip images claiming to go beyond the ROM */
+      if (offset + images[i].size > rom_size)
+	images[i].size = rom_size - offset;
+
+      offset += images[i].size;
+
+      if (pcir[PCI_PCIR_INDICATOR] & PCI_PCIR_LAST_IMAGE)
+	{
+	  i++;
+	  break;
+	}
+    }
+
+  if (i == 0)
+    return 0;
+
+  dev->rom_images = malloc (i * sizeof (struct pci_rom_image));
+  if (!dev->rom_images)
+    return ENOMEM;
+  memcpy (dev->rom_images, images, i * sizeof (struct pci_rom_image));
+  dev->num_rom_images = i;
+
+  return 0;
+}
+
+/*
+ * Read the address windows of `dev', which must be a PCI-to-PCI bridge.
+ */
+error_t
+pci_device_parse_windows (struct pci_device *dev)
+{
+  error_t err;
+  uint8_t io_base, io_limit;
+  uint16_t base, limit;
+  uint32_t upper;
+
+  /* I/O window, 16 or 32 bits, 4K granularity */
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_IO_BASE, &io_base,
+		       sizeof (io_base));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_IO_LIMIT,
+		       &io_limit, sizeof (io_limit));
+  if (err)
+    return err;
+
+  dev->io_window.base = (pciaddr_t) (io_base & 0xF0) << 8;
+  dev->io_window.limit = ((pciaddr_t) (io_limit & 0xF0) << 8) | 0xFFF;
+  if ((io_base & 0x0F) == PCI_IO_32)
+    {
+      err = pci_sys->read (dev->bus, dev->dev, dev->func,
+			   PCI_IO_BASE_UPPER16, &base, sizeof (base));
+      if (err)
+	return err;
+      err = pci_sys->read (dev->bus, dev->dev, dev->func,
+			   PCI_IO_LIMIT_UPPER16, &limit, sizeof (limit));
+      if (err)
+	return err;
+
+      dev->io_window.base |= (pciaddr_t) base << 16;
+      dev->io_window.limit |= (pciaddr_t) limit << 16;
+    }
+
+  /* Memory window, 32 bits, 1M granularity */
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_MEMORY_BASE,
+		       &base, sizeof (base));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_MEMORY_LIMIT,
+		       &limit, sizeof (limit));
+  if (err)
+    return err;
+
+  dev->mem_window.base = (pciaddr_t) (base & 0xFFF0) << 16;
+  dev->mem_window.limit = ((pciaddr_t) (limit & 0xFFF0) << 16) | 0xFFFFF;
+
+  /* Prefetchable memory window, 32 or 64 bits, 1M granularity */
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_PREF_MEMORY_BASE,
+		       &base, sizeof (base));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_PREF_MEMORY_LIMIT,
+		       &limit, sizeof (limit));
+  if (err)
+    return err;
+
+  dev->pref_window.base = (pciaddr_t) (base & 0xFFF0) << 16;
+  dev->pref_window.limit = ((pciaddr_t) (limit & 0xFFF0) << 16) | 0xFFFFF;
+  if ((base & 0x0F) == PCI_PREF_64)
+    {
+      err = pci_sys->read (dev->bus, dev->dev, dev->func,
+			   PCI_PREF_BASE_UPPER32, &upper, sizeof (upper));
+      if (err)
+	return err;
+      dev->pref_window.base |= (pciaddr_t) upper << 32;
+
+      err = pci_sys->read (dev->bus, dev->dev, dev->func,
+			   PCI_PREF_LIMIT_UPPER32, &upper, sizeof (upper));
+      if (err)
+	return err;
+      dev->pref_window.limit |= (pciaddr_t) upper << 32;
+    }
+
+  return 0;
+}
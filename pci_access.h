@@ -64,16 +64,61 @@
 
 typedef uint64_t pciaddr_t;
 
+/* Header registers describing the device's address decoders */
+#define PCI_COMMAND		0x04
+#define PCI_BAR_ADDR_0		0x10
+#define PCI_XROMBAR_ADDR_00	0x30
+#define PCI_XROMBAR_ADDR_01	0x38
+
+/* Some standard capability IDs */
+#define PCI_CAP_ID_PM		0x01
+#define PCI_CAP_ID_MSI		0x05
+#define PCI_CAP_ID_EXP		0x10
+#define PCI_CAP_ID_MSIX		0x11
+
+/* Extended capabilities start right after the standard config space */
+#define PCI_EXT_CAP_START	0x100
+
+/* Size of the memory-mapped configuration window of each function */
+#define PCI_CONFIG_WINDOW_SIZE	4096
+
+/* Code types of expansion ROM images */
+#define PCI_ROM_CODE_X86	0x00
+#define PCI_ROM_CODE_OFW	0x01
+#define PCI_ROM_CODE_HPPA	0x02
+#define PCI_ROM_CODE_EFI	0x03
+
+/* Most images we look for in a ROM */
+#define PCI_ROM_MAX_IMAGES	16
+
+/*
+ * An image in the expansion ROM, as described by its PCI data structure.
+ */
+struct pci_rom_image
+{
+  /* Position and length in the ROM, in bytes */
+  uint32_t offset;
+  uint32_t size;
+
+  /* PCI_ROM_CODE_* */
+  uint8_t code_type;
+};
+
+/*
+ * An address window forwarded downstream by a bridge, closed when `limit'
+ * is below `base'.
+ */
+struct pci_window
+{
+  pciaddr_t base;
+  pciaddr_t limit;		/* Inclusive */
+};
+
 /*
  * BAR descriptor for a PCI device.
  */
 struct pci_mem_region
 {
-  /*
-   * When the region is mapped, this is the pointer to the memory.
-   */
-  void *memory;
-
   /*
    * Base physical address of the region from the CPU's point of view.
    *
@@ -112,6 +157,69 @@ struct pci_mem_region
   unsigned is_64:1;
 };
 
+/*
+ * Capability descriptor.
+ *
+ * Standard capabilities always live below offset 0x100 and extended ones
+ * above it, so the offset tells which list the capability belongs to.
+ */
+struct pci_cap
+{
+  uint16_t id;
+  uint16_t offset;
+};
+
+/*
+ * MSI-X table and Pending Bit Array location.
+ */
+struct pci_msix
+{
+  /*
+   * Number of entries in the table, zero if the device has no MSI-X.
+   */
+  uint16_t table_size;
+
+  /*
+   * BARs holding the table and the PBA, and offsets inside them.
+   */
+  uint8_t table_bar;
+  uint8_t pba_bar;
+  uint32_t table_offset;
+  uint32_t pba_offset;
+};
+
+/* Size in bytes of an MSI-X table entry */
+#define PCI_MSIX_ENTRY_SIZE	16
+
+/* Sizes in bytes of the MSI-X table and PBA of `msix' */
+#define PCI_MSIX_TABLE_BYTES(msix)	((msix)->table_size * PCI_MSIX_ENTRY_SIZE)
+#define PCI_MSIX_PBA_BYTES(msix)	((((msix)->table_size + 63) / 64) * 8)
+
+/*
+ * PCI Express link of a device.
+ */
+struct pci_link
+{
+  /*
+   * Offset of the PCI Express capability, zero for conventional PCI devices.
+   */
+  uint16_t cap;
+
+  /*
+   * Device/port type from the capability flags.
+   */
+  uint8_t port_type;
+
+  /*
+   * Supported and negotiated link speed and width. Speeds are encoded as in
+   * the Link Capabilities register: 1 is 2.5GT/s, 2 is 5GT/s and so on.
+   */
+  uint8_t max_speed;
+  uint8_t max_width;
+  uint8_t speed;
+  uint8_t width;
+};
+
 /*
  * PCI device.
  *
@@ -152,14 +260,57 @@ struct pci_device
   pciaddr_t rom_base;
 
   /*
-   * Mapped ROM
+   * Images found in the ROM, parsed from the copy below.
    */
-  void *rom_memory;
+  struct pci_rom_image *rom_images;
+  uint8_t num_rom_images;
+
+  /*
+   * Copy of the ROM in memory, read on first access, and its size.
+   */
+  void *rom_shadow;
+  size_t rom_shadow_size;
 
   /*
    * Size of the configuration space
    */
   size_t config_size;
+
+  /*
+   * Standard and extended capabilities, sorted by list, ID and offset.
+   */
+  struct pci_cap *caps;
+  uint16_t num_caps;
+
+  /*
+   * MSI-X structures, if any.
+   */
+  struct pci_msix msix;
+
+  /*
+   * PCI Express link, if any.
+   */
+  struct pci_link link;
+
+  /*
+   * Index in the device list of the bridge this device sits under, negative
+   * for devices on a root bus.
+   */
+  int32_t upstream;
+
+  /*
+   * Bus range behind this device, only for bridges.
+   */
+  uint8_t secondary_bus;
+  uint8_t subordinate_bus;
+
+  /*
+   * I/O, memory and prefetchable memory windows, only for PCI-to-PCI
+   * bridges.
+   */
+  struct pci_window io_window;
+  struct pci_window mem_window;
+  struct pci_window pref_window;
 };
 
 typedef error_t (*pci_io_op_t) (unsigned bus, unsigned dev, unsigned func,
@@ -168,6 +319,12 @@ typedef error_t (*pci_io_op_t) (unsigned bus, unsigned dev, unsigned func,
 typedef error_t (*pci_refresh_dev_op_t) (struct pci_device * dev,
 					 int num_region, int rom);
 
+typedef error_t (*pci_read_rom_op_t) (struct pci_device * dev,
+				      pciaddr_t offset, size_t len,
+				      void *data);
+typedef error_t (*pci_config_addr_op_t) (struct pci_device * dev,
+					 pciaddr_t * addr);
+
 /* Global PCI data */
 struct pci_system
 {
@@ -178,10 +335,30 @@ struct pci_system
   pci_io_op_t read;
   pci_io_op_t write;
   pci_refresh_dev_op_t device_refresh;
+
+  /*
+   * Read from the expansion ROM. The decoder is only enabled for the
+   * duration of the call.
+   */
+  pci_read_rom_op_t device_read_rom;
+
+  /*
+   * Physical address of the memory-mapped configuration space of a device.
+   * Null for backends that only have I/O port access.
+   */
+  pci_config_addr_op_t device_config_addr;
 };
 
 struct pci_system *pci_sys;
 
 int pci_system_init (void);
+error_t pci_device_parse_caps (struct pci_device *dev);
+struct pci_cap *pci_device_find_cap (struct pci_device *dev, uint16_t id,
+				     int ext, size_t * count);
+error_t pci_device_parse_msix (struct pci_device *dev);
+error_t pci_device_parse_link (struct pci_device *dev);
+error_t pci_device_refresh_link (struct pci_device *dev);
+error_t pci_device_parse_rom (struct pci_device *dev);
+error_t pci_device_parse_windows (struct pci_device *dev);
 
 #endif /* PCI_ACCESS_H */
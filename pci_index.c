@@ -0,0 +1,347 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Physical address index.
+ *
+ * Every assigned BAR, ROM and bridge window is an interval in the memory or
+ * the I/O space. Each space has two lists: one for device resources, which
+ * shouldn't overlap, and one for bridge windows, which nest.
+ *
+ * Intervals are stored as a tree, each one being the child of the smallest
+ * interval enclosing it. The array is in level order, so the children of an
+ * entry are a slice of it, sorted by start address. A lookup is a binary
+ * search among the top level intervals, then among the children of the one
+ * containing the address, and so on down to the innermost one.
+ *
+ * An interval partially overlapping another, only possible on a broken
+ * configuration which is reported at build time, is kept next to it. The
+ * addresses they share are found in the later one.
+ *
+ * The index is built at startup and rebuilt when a config write moves a
+ * decoder.
+ */
+
+#include <pci_index.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <error.h>
+
+struct pci_index_entry
+{
+  pciaddr_t start, end;		/* End is exclusive */
+  uint32_t device;		/* Index in pci_sys->devices */
+  uint8_t region;
+  uint32_t first_child, num_children;	/* Slice of the list */
+};
+
+struct pci_index_list
+{
+  struct pci_index_entry *entries;
+  size_t num_entries;
+  size_t num_roots;		/* Top level intervals, first in the list */
+};
+
+/* Resources and windows, for each space */
+static struct pci_index_list index_res[2], index_win[2];
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int
+entry_cmp (const void *a, const void *b)
+{
+  const struct pci_index_entry *ea = a, *eb = b;
+
+  if (ea->start != eb->start)
+    return ea->start < eb->start ? -1 : 1;
+  if (ea->end != eb->end)
+    /* Enclosing intervals first */
+    return ea->end > eb->end ? -1 : 1;
+  return 0;
+}
+
+static void
+list_add (struct pci_index_list *list, pciaddr_t start, pciaddr_t size,
+	  uint32_t device, uint8_t region)
+{
+  struct pci_index_entry *e;
+
+  /* Unassigned */
+  if (start == 0 || size == 0)
+    return;
+
+  e = &list->entries[list->num_entries++];
+  e->start = start;
+  e->end = start + size;
+  e->device = device;
+  e->region = region;
+}
+
+/* Report resources `e' and `prev' of `space' claiming the same addresses */
+static void
+report_overlap (const char *space, struct pci_index_entry *e,
+		struct pci_index_entry *prev)
+{
+  struct pci_device *d, *pd;
+
+  d = &pci_sys->devices[e->device];
+  pd = &pci_sys->devices[prev->device];
+  error (0, 0, "%s resource %d of %04x:%02x:%02x.%u overlaps resource "
+	 "%d of %04x:%02x:%02x.%u", space, e->region, d->domain, d->bus,
+	 d->dev, d->func, prev->region, pd->domain, pd->bus, pd->dev,
+	 pd->func);
+}
+
+/*
+ * Sort `list' and lay it out as a tree in level order. When `space' is not
+ * null, intervals overlapping others are reported as errors.
+ */
+static error_t
+list_nest (struct pci_index_list *list, const char *space)
+{
+  struct pci_index_entry *sorted, *out;
+  size_t *parent, *stack, *first, *next, *children, *order;
+  size_t n, i, top, head, tail, c;
+
+  n = list->num_entries;
+  sorted = list->entries;
+  qsort (sorted, n, sizeof (struct pci_index_entry), entry_cmp);
+
+  out = malloc (n * sizeof (struct pci_index_entry));
+  parent = malloc (6 * (n + 2) * sizeof (size_t));
+  if (!out || !parent)
+    {
+      free (out);
+      free (parent);
+      return ENOMEM;
+    }
+  stack = parent + (n + 2);
+  first = stack + (n + 2);
+  next = first + (n + 2);
+  children = next + (n + 2);
+  order = children + (n + 2);
+
+  /*
+   * Find the parent of each interval: the innermost one still open when it
+   * starts. `n' stands for none.
+   */
+  top = 0;
+  for (i = 0; i < n; i++)
+    {
+      while (top > 0 && sorted[stack[top - 1]].end <= sorted[i].start)
+	top--;
+      if (top > 0 && space)
+	report_overlap (space, &sorted[i], &sorted[stack[top - 1]]);
+      while (top > 0 && sorted[stack[top - 1]].end < sorted[i].end)
+	/* Partial overlap, make it a sibling */
+	top--;
+      parent[i] = top > 0 ? stack[top - 1] : n;
+      stack[top++] = i;
+    }
+
+  /*
+   * Group the children of each interval, in sorted order: those of `i' go
+   * from `first[i]' to `first[i + 1]' in `children'.
+   */
+  memset (first, 0, (n + 2) * sizeof (size_t));
+  for (i = 0; i < n; i++)
+    first[parent[i] + 1]++;
+  for (i = 0; i <= n; i++)
+    first[i + 1] += first[i];
+  memcpy (next, first, (n + 2) * sizeof (size_t));
+  for (i = 0; i < n; i++)
+    children[next[parent[i]]++] = i;
+
+  /* Lay the tree out level by level, top level intervals first */
+  tail = 0;
+  for (c = first[n]; c < first[n + 1]; c++)
+    order[tail++] = children[c];
+  list->num_roots = tail;
+  for (head = 0; head < tail; head++)
+    {
+      i = order[head];
+      out[head] = sorted[i];
+      out[head].first_child = tail;
+      for (c = first[i]; c < first[i + 1]; c++)
+	order[tail++] = children[c];
+      out[head].num_children = tail - out[head].first_child;
+    }
+
+  free (parent);
+  free (sorted);
+  list->entries = out;
+
+  return 0;
+}
+
+/*
+ * Find the innermost interval in `list' containing `addr'. Return a pointer
+ * to it, or null if there's none.
+ */
+static struct pci_index_entry *
+list_lookup (struct pci_index_list *list, pciaddr_t addr)
+{
+  struct pci_index_entry *best = 0;
+  size_t first, count, lo, hi, mid;
+
+  first = 0;
+  count = list->num_roots;
+  while (count > 0)
+    {
+      /* Find the first sibling starting after `addr' */
+      lo = first;
+      hi = first + count;
+      while (lo < hi)
+	{
+	  mid = lo + (hi - lo) / 2;
+	  if (list->entries[mid].start <= addr)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      /* The one before may contain it, then go down into its children */
+      if (lo == first || list->entries[lo - 1].end <= addr)
+	break;
+      best = &list->entries[lo - 1];
+      first = best->first_child;
+      count = best->num_children;
+    }
+
+  return best;
+}
+
+/* Build the index from the current state of all devices */
+error_t
+pci_index_build (void)
+{
+  error_t err;
+  struct pci_index_list res[2], win[2];
+  struct pci_device *d;
+  size_t i, n;
+  int j;
+
+  /* Worst case sizes */
+  n = pci_sys->num_devices;
+  for (j = 0; j < 2; j++)
+    {
+      res[j].num_entries = win[j].num_entries = 0;
+      res[j].entries = malloc (n * 7 * sizeof (struct pci_index_entry));
+      win[j].entries = malloc (n * 2 * sizeof (struct pci_index_entry));
+    }
+  if (!res[0].entries || !res[1].entries || !win[0].entries
+      || !win[1].entries)
+    {
+      for (j = 0; j < 2; j++)
+	{
+	  free (res[j].entries);
+	  free (win[j].entries);
+	}
+      return ENOMEM;
+    }
+
+  for (i = 0, d = pci_sys->devices; i < n; i++, d++)
+    {
+      for (j = 0; j < 6; j++)
+	list_add (d->regions[j].is_IO ? &res[PCI_INDEX_SPACE_IO]
+		  : &res[PCI_INDEX_SPACE_MEM], d->regions[j].base_addr,
+		  d->regions[j].size, i, j);
+
+      list_add (&res[PCI_INDEX_SPACE_MEM], d->rom_base, d->rom_size, i,
+		PCI_INDEX_ROM);
+
+#define ADD_WINDOW(list, w, region) \
+      if ((w).limit >= (w).base) \
+	list_add (list, (w).base, (w).limit - (w).base + 1, i, region)
+
+      ADD_WINDOW (&win[PCI_INDEX_SPACE_IO], d->io_window,
+		  PCI_INDEX_IO_WINDOW);
+      ADD_WINDOW (&win[PCI_INDEX_SPACE_MEM], d->mem_window,
+		  PCI_INDEX_MEM_WINDOW);
+      ADD_WINDOW (&win[PCI_INDEX_SPACE_MEM], d->pref_window,
+		  PCI_INDEX_PREF_WINDOW);
+
+#undef ADD_WINDOW
+    }
+
+  err = list_nest (&res[PCI_INDEX_SPACE_MEM], "Memory");
+  if (!err)
+    err = list_nest (&res[PCI_INDEX_SPACE_IO], "I/O");
+  for (j = 0; j < 2 && !err; j++)
+    err = list_nest (&win[j], 0);
+  if (err)
+    {
+      for (j = 0; j < 2; j++)
+	{
+	  free (res[j].entries);
+	  free (win[j].entries);
+	}
+      return err;
+    }
+
+  /* Replace the old index */
+  pthread_rwlock_wrlock (&index_lock);
+  for (j = 0; j < 2; j++)
+    {
+      free (index_res[j].entries);
+      free (index_win[j].entries);
+      index_res[j] = res[j];
+      index_win[j] = win[j];
+    }
+  pthread_rwlock_unlock (&index_lock);
+
+  return 0;
+}
+
+/*
+ * Find the device resource containing `addr' in `space'. Bridge windows
+ * are only reported when no device resource claims the address.
+ */
+error_t
+pci_index_lookup (int space, pciaddr_t addr, struct pci_addr_owner *owner)
+{
+  struct pci_index_entry *e;
+  struct pci_device *d;
+
+  if (space != PCI_INDEX_SPACE_MEM && space != PCI_INDEX_SPACE_IO)
+    return EINVAL;
+
+  pthread_rwlock_rdlock (&index_lock);
+
+  e = list_lookup (&index_res[space], addr);
+  if (!e)
+    e = list_lookup (&index_win[space], addr);
+
+  if (e)
+    {
+      d = &pci_sys->devices[e->device];
+      owner->domain = d->domain;
+      owner->bus = d->bus;
+      owner->dev = d->dev;
+      owner->func = d->func;
+      owner->region = e->region;
+      owner->offset = addr - e->start;
+    }
+
+  pthread_rwlock_unlock (&index_lock);
+
+  return e ? 0 : ENXIO;
+}
@@ -0,0 +1,53 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Header for the physical address index */
+
+#ifndef PCI_INDEX_H
+#define PCI_INDEX_H
+
+#include <pci_access.h>
+
+/* Address spaces */
+#define PCI_INDEX_SPACE_MEM	0
+#define PCI_INDEX_SPACE_IO	1
+
+/* Resource numbers beyond the six BARs */
+#define PCI_INDEX_ROM		6
+#define PCI_INDEX_IO_WINDOW	7
+#define PCI_INDEX_MEM_WINDOW	8
+#define PCI_INDEX_PREF_WINDOW	9
+
+/* Owner of an address, as returned to clients */
+struct pci_addr_owner
+{
+  uint32_t domain;
+  uint8_t bus;
+  uint8_t dev;
+  uint8_t func;
+  uint8_t region;		/* BAR number or PCI_INDEX_* */
+  uint64_t offset;		/* From the start of the resource */
+};
+
+error_t pci_index_build (void);
+error_t pci_index_lookup (int space, pciaddr_t addr,
+			  struct pci_addr_owner *owner);
+
+#endif /* PCI_INDEX_H */
@@ -0,0 +1,294 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Physical memory mapping manager.
+ *
+ * All accesses to device memory go through windows mapped from a single
+ * /dev/mem handle. Regions up to PCI_MAP_WINDOW_SIZE bytes are mapped in
+ * one window, larger ones in as many windows as needed, on demand. The total
+ * size of the mappings is kept under a configurable budget by unmapping the
+ * least recently used windows nobody is using.
+ */
+
+#include <pci_map.h>
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <hurd.h>
+
+/* Number of buckets in the window hash table, must be a power of two */
+#define PCI_MAP_HASH_SIZE 256
+
+#define PCI_MAP_HASH(start) \
+  (((start) / PCI_MAP_WINDOW_SIZE ^ (start) / vm_page_size) \
+   & (PCI_MAP_HASH_SIZE - 1))
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The /dev/mem handle, and its memory objects */
+static mach_port_t mem_port = MACH_PORT_NULL;
+static memory_object_t mem_rdobj = MACH_PORT_NULL;
+static memory_object_t mem_wrobj = MACH_PORT_NULL;
+
+static struct pci_map_window *map_hash[PCI_MAP_HASH_SIZE];
+
+/* Unreferenced windows, most recently used first */
+static struct pci_map_window *lru_first, *lru_last;
+
+/* Mapped bytes, and the limit */
+static size_t map_mapped;
+static size_t map_budget = (size_t) PCI_MAP_BUDGET_DEFAULT * 1024 * 1024;
+
+/* Open /dev/mem, once. Must be called with `map_lock' held. */
+static error_t
+map_open (void)
+{
+  error_t err;
+
+  if (mem_port != MACH_PORT_NULL)
+    return 0;
+
+  mem_port = file_name_lookup ("/dev/mem", O_READ | O_WRITE, 0);
+  if (mem_port == MACH_PORT_NULL)
+    return errno;
+
+  err = io_map (mem_port, &mem_rdobj, &mem_wrobj);
+  if (err)
+    {
+      mach_port_deallocate (mach_task_self (), mem_port);
+      mem_port = MACH_PORT_NULL;
+      return err;
+    }
+
+  return 0;
+}
+
+static void
+lru_unlink (struct pci_map_window *win)
+{
+  if (win->lru_prev)
+    win->lru_prev->lru_next = win->lru_next;
+  else
+    lru_first = win->lru_next;
+  if (win->lru_next)
+    win->lru_next->lru_prev = win->lru_prev;
+  else
+    lru_last = win->lru_prev;
+  win->lru_next = win->lru_prev = 0;
+}
+
+/* Unmap and free `win', which must be unreferenced */
+static void
+window_destroy (struct pci_map_window *win)
+{
+  struct pci_map_window **prevp;
+
+  lru_unlink (win);
+
+  for (prevp = &map_hash[PCI_MAP_HASH (win->start)]; *prevp;
+       prevp = &(*prevp)->next)
+    if (*prevp == win)
+      {
+	*prevp = win->next;
+	break;
+      }
+
+  vm_deallocate (mach_task_self (), win->addr, win->size);
+  map_mapped -= win->size;
+  free (win);
+}
+
+/* Unmap unused windows until we are back under budget */
+static void
+map_trim (void)
+{
+  while (map_mapped > map_budget && lru_last)
+    window_destroy (lru_last);
+}
+
+/*
+ * Map the window of region [`base', `base' + `size') which contains
+ * `offset'.
+ *
+ * On success, `*addr' points to `offset' and `*len' is the number of bytes
+ * available from there on in the window. The window must be released with
+ * pci_map_release() when done.
+ */
+error_t
+pci_map_acquire (pciaddr_t base, pciaddr_t size, pciaddr_t offset,
+		 void **addr, size_t * len, struct pci_map_window **win)
+{
+  error_t err;
+  pciaddr_t start, end, page;
+  struct pci_map_window *w;
+
+  if (offset >= size)
+    return EINVAL;
+
+  /* Window boundaries */
+  if (size <= PCI_MAP_WINDOW_SIZE)
+    {
+      start = base;
+      end = base + size;
+    }
+  else
+    {
+      start = base + (offset & ~((pciaddr_t) PCI_MAP_WINDOW_SIZE - 1));
+      end = start + PCI_MAP_WINDOW_SIZE;
+      if (end > base + size)
+	end = base + size;
+    }
+
+  /* We can only map what a vm_offset_t can address */
+  if (end - 1 > (vm_offset_t) - 1)
+    return EOPNOTSUPP;
+
+  pthread_mutex_lock (&map_lock);
+
+  for (w = map_hash[PCI_MAP_HASH (start)]; w; w = w->next)
+    if (w->start == start && w->end == end)
+      break;
+
+  if (w)
+    {
+      /* Already mapped */
+      if (w->refs++ == 0)
+	lru_unlink (w);
+    }
+  else
+    {
+      err = map_open ();
+      if (err)
+	{
+	  pthread_mutex_unlock (&map_lock);
+	  return err;
+	}
+
+      if (mem_wrobj == MACH_PORT_NULL)
+	{
+	  pthread_mutex_unlock (&map_lock);
+	  return EPERM;
+	}
+
+      w = calloc (1, sizeof (struct pci_map_window));
+      if (!w)
+	{
+	  pthread_mutex_unlock (&map_lock);
+	  return ENOMEM;
+	}
+
+      page = trunc_page (start);
+      w->start = start;
+      w->end = end;
+      w->size = round_page (end) - page;
+      err = vm_map (mach_task_self (), &w->addr, w->size, 0, 1, mem_wrobj,
+		    page, 0, VM_PROT_READ | VM_PROT_WRITE,
+		    VM_PROT_READ | VM_PROT_WRITE, VM_INHERIT_NONE);
+      if (err)
+	{
+	  pthread_mutex_unlock (&map_lock);
+	  free (w);
+	  return err;
+	}
+
+      w->refs = 1;
+      w->next = map_hash[PCI_MAP_HASH (start)];
+      map_hash[PCI_MAP_HASH (start)] = w;
+      map_mapped += w->size;
+
+      map_trim ();
+    }
+
+  pthread_mutex_unlock (&map_lock);
+
+  *addr = (void *) (w->addr + (base + offset - trunc_page (start)));
+  *len = end - (base + offset);
+  *win = w;
+
+  return 0;
+}
+
+/* Drop a reference to `win' */
+void
+pci_map_release (struct pci_map_window *win)
+{
+  pthread_mutex_lock (&map_lock);
+
+  if (--win->refs == 0)
+    {
+      /* Move to the head of the LRU list */
+      win->lru_prev = 0;
+      win->lru_next = lru_first;
+      if (lru_first)
+	lru_first->lru_prev = win;
+      else
+	lru_last = win;
+      lru_first = win;
+
+      map_trim ();
+    }
+
+  pthread_mutex_unlock (&map_lock);
+}
+
+/*
+ * Get a send right to the memory object for the whole physical memory, the
+ * one allowing `prot' access.
+ */
+error_t
+pci_map_get_object (vm_prot_t prot, memory_object_t * obj)
+{
+  error_t err;
+
+  pthread_mutex_lock (&map_lock);
+
+  err = map_open ();
+  if (!err)
+    {
+      *obj = (prot & VM_PROT_WRITE) ? mem_wrobj : mem_rdobj;
+      if (*obj == MACH_PORT_NULL)
+	err = EPERM;
+      else
+	err = mach_port_mod_refs (mach_task_self (), *obj,
+				  MACH_PORT_RIGHT_SEND, 1);
+    }
+
+  pthread_mutex_unlock (&map_lock);
+
+  return err;
+}
+
+/* Set the mapping budget, in bytes */
+void
+pci_map_set_budget (size_t budget)
+{
+  pthread_mutex_lock (&map_lock);
+  map_budget = budget;
+  map_trim ();
+  pthread_mutex_unlock (&map_lock);
+}
+
+/* Get the mapping budget, in bytes */
+size_t
+pci_map_get_budget (void)
+{
+  return map_budget;
+}
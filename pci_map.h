@@ -0,0 +1,68 @@
+/*
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of the GNU Hurd.
+
+   The GNU Hurd is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   The GNU Hurd is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with the GNU Hurd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Header for the physical memory mapping manager */
+
+#ifndef PCI_MAP_H
+#define PCI_MAP_H
+
+#include <mach.h>
+
+#include <pci_access.h>
+
+/* Large BARs are mapped in windows this many bytes long */
+#define PCI_MAP_WINDOW_SIZE (1024 * 1024)
+
+/* Default amount of virtual memory, in MiB, used for mappings */
+#define PCI_MAP_BUDGET_DEFAULT 256
+
+/*
+ * A mapped window of physical memory.
+ *
+ * Windows are reference counted. Unreferenced windows stay mapped until
+ * the budget is exceeded, then the least recently used ones are unmapped.
+ */
+struct pci_map_window
+{
+  /* Physical range covered by the window */
+  pciaddr_t start, end;
+
+  /* Where the page containing `start' is mapped, and the mapping size */
+  vm_address_t addr;
+  vm_size_t size;
+
+  /* Number of users */
+  int refs;
+
+  /* Hash chain */
+  struct pci_map_window *next;
+
+  /* Position in the LRU list, only while unreferenced */
+  struct pci_map_window *lru_next, *lru_prev;
+};
+
+error_t pci_map_acquire (pciaddr_t base, pciaddr_t size, pciaddr_t offset,
+			 void **addr, size_t * len,
+			 struct pci_map_window **win);
+void pci_map_release (struct pci_map_window *win);
+error_t pci_map_get_object (vm_prot_t prot, memory_object_t * obj);
+void pci_map_set_budget (size_t budget);
+size_t pci_map_get_budget (void);
+
+#endif /* PCI_MAP_H */
@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <hurd/netfs.h>
@@ -31,48 +33,356 @@
 #include <ncache.h>
 #include <func_files.h>
 
+/* Returned directory entries are aligned to blocks this many bytes long.
+ * Must be a power of two.  */
+#define DIRENT_ALIGN 4
+#define DIRENT_NAME_OFFS offsetof (struct dirent, d_name)
+
+/* Length is structure before the name + the name + '\0', all
+ *    padded to a four-byte alignment.  */
+#define DIRENT_LEN(name_len)                                                  \
+  ((DIRENT_NAME_OFFS + (name_len) + 1 + (DIRENT_ALIGN - 1))                   \
+   & ~(DIRENT_ALIGN - 1))
+
+/* FNV-1a hash of an entry name */
+uint32_t
+pcifs_name_hash (const char *name)
+{
+  uint32_t hash = 2166136261U;
+  int i;
+
+  for (i = 0; i < NAME_SIZE && name[i]; i++)
+    {
+      hash ^= (unsigned char) name[i];
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+/* Number of hash table slots of a directory with `n' entries */
+static uint32_t
+dir_hash_size (size_t n)
+{
+  uint32_t size;
+
+  /* Keep the table at most half full */
+  for (size = 4; size < n * 2; size <<= 1);
+
+  return size;
+}
+
+/* Fill the name hash table of `dir', already zeroed */
+static void
+dir_build_hash (struct pcifs_dir *dir)
+{
+  uint32_t slot;
+  int i;
+
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      slot = dir->entries[i]->name_hash & (dir->hash_size - 1);
+      while (dir->hash[slot])
+	slot = (slot + 1) & (dir->hash_size - 1);
+      dir->hash[slot] = i + 1;
+    }
+}
+
+/*
+ * Serialize the listing of `dir' to `dir->dirents', and return its length.
+ * The tree doesn't change once built, so this is done once and listings
+ * are copied straight from the result.
+ */
+static size_t
+dir_serialize (struct pcifs_dir *dir)
+{
+  struct pcifs_dirent *e;
+  struct dirent hdr;
+  size_t name_len, size;
+  char *p;
+  int i;
+
+  size = 0;
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      e = dir->entries[i];
+      p = dir->dirents + size;
+      name_len = strlen (e->cold->name) + 1;
+
+      hdr.d_namlen = name_len;
+      hdr.d_fileno = e->cold->ino;
+      hdr.d_reclen = DIRENT_LEN (name_len);
+      hdr.d_type = IFTODT (ENTRY_STAT_TMPL (e)->st_mode);
+
+      memcpy (p, &hdr, DIRENT_NAME_OFFS);
+      memcpy (p + DIRENT_NAME_OFFS, e->cold->name, name_len);
+
+      dir->dirent_offs[i] = size;
+      size += hdr.d_reclen;
+    }
+  dir->dirent_offs[i] = size;
+
+  return size;
+}
+
+/*
+ * Lay the directories of `fs' out: the entries of each directory go
+ * contiguous in `fs->children', in creation order, followed by all
+ * offsets, hash tables and listings.
+ */
+static error_t
+fs_index_dirs (struct pcifs *fs)
+{
+  struct pcifs_dirent *e, **children;
+  struct pcifs_dir *d;
+  uint32_t *offs;
+  uint16_t *slots;
+  char *listings;
+  size_t nchildren, nslots, nbytes, i;
+
+  /* Assign directories and count their entries */
+  d = fs->dirs;
+  for (i = 0, e = fs->entries; i < fs->num_entries; i++, e++)
+    if (e->kind == FILE_KIND_DIR || e->kind == FILE_KIND_ROM_DIR)
+      {
+	memset (d, 0, sizeof (struct pcifs_dir));
+	d->filled = e->kind == FILE_KIND_DIR;
+	e->dir = d++;
+      }
+  nchildren = fs->num_entries - 1;
+  nbytes = 0;
+  for (i = 1, e = fs->entries + 1; i < fs->num_entries; i++, e++)
+    {
+      e->parent->dir->num_entries++;
+      if (e->parent->kind == FILE_KIND_ROM_DIR)
+	/* Names come later, make room for the longest */
+	nbytes += DIRENT_LEN (NAME_SIZE);
+      else
+	nbytes += DIRENT_LEN (strlen (e->cold->name) + 1);
+    }
+  nslots = 0;
+  for (i = 0, d = fs->dirs; i < fs->num_dirs; i++, d++)
+    nslots += dir_hash_size (d->num_entries);
+
+  free (fs->children);
+  fs->children = calloc (1, nchildren * sizeof (struct pcifs_dirent *)
+			 + (nchildren + fs->num_dirs) * sizeof (uint32_t)
+			 + nslots * sizeof (uint16_t) + nbytes);
+  if (!fs->children)
+    return ENOMEM;
+  offs = (uint32_t *) (fs->children + nchildren);
+  slots = (uint16_t *) (offs + nchildren + fs->num_dirs);
+  listings = (char *) (slots + nslots);
+
+  /* Give each directory its slices */
+  children = fs->children;
+  for (i = 0, d = fs->dirs; i < fs->num_dirs; i++, d++)
+    {
+      d->entries = children;
+      children += d->num_entries;
+      d->dirent_offs = offs;
+      offs += d->num_entries + 1;
+      d->hash = slots;
+      d->hash_size = dir_hash_size (d->num_entries);
+      slots += d->hash_size;
+      d->num_entries = 0;
+    }
+
+  for (i = 1, e = fs->entries + 1; i < fs->num_entries; i++, e++)
+    {
+      d = e->parent->dir;
+      d->entries[d->num_entries++] = e;
+    }
+
+  for (i = 0, d = fs->dirs; i < fs->num_dirs; i++, d++)
+    if (d->filled)
+      {
+	dir_build_hash (d);
+	d->dirents = listings;
+	listings += dir_serialize (d);
+      }
+    else
+      {
+	/* Keep the room, but show nothing until filled */
+	d->dirents = listings;
+	listings += d->num_entries * DIRENT_LEN (NAME_SIZE);
+	d->num_entries = 0;
+      }
+
+  return 0;
+}
+
+/*
+ * Show the first `n' entries reserved in `dir', once their names and sizes
+ * are set. Only done once, for the ROM images directory.
+ */
+void
+pcifs_dir_fill (struct pcifs_dir *dir, size_t n)
+{
+  int i;
+
+  dir->num_entries = n;
+  for (i = 0; i < n; i++)
+    dir->entries[i]->name_hash =
+      pcifs_name_hash (dir->entries[i]->cold->name);
+  dir_build_hash (dir);
+  dir_serialize (dir);
+}
+
+/* Find the entry called `name' in `dir' */
+struct pcifs_dirent *
+pcifs_dir_lookup (struct pcifs_dir *dir, const char *name)
+{
+  struct pcifs_dirent *e;
+  uint32_t hash, slot;
+
+  if (!dir->hash)
+    return 0;
+
+  hash = pcifs_name_hash (name);
+  for (slot = hash & (dir->hash_size - 1); dir->hash[slot];
+       slot = (slot + 1) & (dir->hash_size - 1))
+    {
+      e = dir->entries[dir->hash[slot] - 1];
+      if (e->name_hash == hash && !strncmp (e->cold->name, name, NAME_SIZE))
+	return e;
+    }
+
+  return 0;
+}
+
+/*
+ * Allocate `nentries' entries, their cold data and `ndirs' directories in
+ * one block, and link each entry to its cold data.
+ */
+static struct pcifs_dirent *
+alloc_entries (size_t nentries, size_t ndirs, struct pcifs_dir **dirs)
+{
+  struct pcifs_dirent *list;
+  struct pcifs_dirent_cold *cold;
+  size_t i;
+
+  list = calloc (1, nentries * (sizeof (struct pcifs_dirent)
+				+ sizeof (struct pcifs_dirent_cold))
+		 + ndirs * sizeof (struct pcifs_dir));
+  if (!list)
+    return 0;
+
+  cold = (struct pcifs_dirent_cold *) (list + nentries);
+  for (i = 0; i < nentries; i++)
+    list[i].cold = &cold[i];
+  *dirs = (struct pcifs_dir *) (cold + nentries);
+
+  return list;
+}
+
+/*
+ * Set `*tmpl' to the stat template matching the mode, owner and group of
+ * `st', adding one if needed. The rest of the buffer is the same for all
+ * entries, as it comes from the root.
+ *
+ * Only called at startup and by fsysopts with RPCs inhibited, while other
+ * threads may still read templates through the entries. The table of
+ * templates may move but the templates themselves don't.
+ */
+static error_t
+stat_tmpl_get (struct pcifs *fs, io_statbuf_t * st, io_statbuf_t ** tmpl)
+{
+  io_statbuf_t **tmpls, *t;
+  size_t i;
+
+  for (i = 0; i < fs->num_stat_tmpls; i++)
+    {
+      t = fs->stat_tmpls[i];
+      if (t->st_mode == st->st_mode && t->st_uid == st->st_uid
+	  && t->st_gid == st->st_gid)
+	{
+	  *tmpl = t;
+	  return 0;
+	}
+    }
+
+  tmpls = realloc (fs->stat_tmpls,
+		   (fs->num_stat_tmpls + 1) * sizeof (io_statbuf_t *));
+  if (!tmpls)
+    return ENOMEM;
+  fs->stat_tmpls = tmpls;
+
+  t = malloc (sizeof (io_statbuf_t));
+  if (!t)
+    return ENOMEM;
+
+  /* Per-entry fields are kept in the entries */
+  *t = *st;
+  t->st_ino = 0;
+  t->st_size = 0;
+  memset (&t->st_atim, 0, sizeof (struct timespec));
+  memset (&t->st_mtim, 0, sizeof (struct timespec));
+  memset (&t->st_ctim, 0, sizeof (struct timespec));
+
+  tmpls[fs->num_stat_tmpls++] = t;
+  *tmpl = t;
+
+  return 0;
+}
+
+/* Fill `st' with the stat template of `e' and its own fields */
+void
+entry_get_stat (struct pcifs_dirent *e, io_statbuf_t * st)
+{
+  *st = *ENTRY_STAT_TMPL (e);
+  st->st_ino = e->cold->ino;
+  st->st_size = e->cold->size;
+  st->st_atim = e->cold->atime;
+  st->st_mtim = e->cold->mtime;
+  st->st_ctim = e->cold->ctime;
+}
+
+/* Update the times of `e' as fshelp_touch() does */
+void
+entry_touch (struct pcifs_dirent *e, int what)
+{
+  io_statbuf_t st;
+
+  fshelp_touch (&st, what, pcifs_maptime);
+  if (what & TOUCH_ATIME)
+    e->cold->atime = st.st_atim;
+  if (what & TOUCH_MTIME)
+    e->cold->mtime = st.st_mtim;
+  if (what & TOUCH_CTIME)
+    e->cold->ctime = st.st_ctim;
+}
+
+/* Fill `entry', whose cold data must be already linked */
 static error_t
 create_dir_entry (int32_t domain, int16_t bus, int16_t dev,
 		  int16_t func, int32_t device_class, char *name,
 		  struct pcifs_dirent *parent, io_statbuf_t stat,
 		  struct node *node, struct pci_device *device,
-		  struct pcifs_dirent *entry)
+		  uint8_t kind, uint8_t index, struct pcifs_dirent *entry)
 {
-  uint16_t parent_num_entries;
-
   entry->domain = domain;
   entry->bus = bus;
   entry->dev = dev;
   entry->func = func;
   entry->device_class = device_class;
-  strncpy (entry->name, name, NAME_SIZE);
+  strncpy (entry->cold->name, name, NAME_SIZE);
+  entry->name_hash = pcifs_name_hash (entry->cold->name);
   entry->parent = parent;
-  entry->stat = stat;
+  entry->cold->size = stat.st_size;
+  entry->cold->atime = stat.st_atim;
+  entry->cold->mtime = stat.st_mtim;
+  entry->cold->ctime = stat.st_ctim;
   entry->dir = 0;
   entry->node = node;
   entry->device = device;
+  entry->kind = kind;
+  entry->index = index;
+  entry->ncache_list = NCACHE_NONE;
+  entry->ncache_ref = 0;
+  entry->ncache_next = entry->ncache_prev = 0;
 
-  /* Update parent's child list */
-  if (entry->parent)
-    {
-      if (!entry->parent->dir)
-	{
-	  /* First child */
-	  entry->parent->dir = calloc (1, sizeof (struct pcifs_dir));
-	  if (!entry->parent->dir)
-	    return ENOMEM;
-	}
-
-      parent_num_entries = entry->parent->dir->num_entries++;
-      entry->parent->dir->entries = realloc (entry->parent->dir->entries,
-					     entry->parent->dir->num_entries *
-					     sizeof (struct pcifs_dirent *));
-      if (!entry->parent->dir->entries)
-	return ENOMEM;
-      entry->parent->dir->entries[parent_num_entries] = entry;
-    }
-
-  return 0;
+  return stat_tmpl_get (fs, &stat, &entry->cold->stat_tmpl);
 }
 
 error_t
@@ -89,6 +399,7 @@ error_t
 init_file_system (file_t underlying_node, struct pcifs * fs)
 {
   error_t err;
+  int i;
   struct node *np;
   io_statbuf_t underlying_node_stat;
 
@@ -111,22 +422,23 @@ init_file_system (file_t underlying_node, struct pcifs * fs)
   fshelp_touch (&np->nn_stat, TOUCH_ATIME | TOUCH_MTIME | TOUCH_CTIME,
 		pcifs_maptime);
 
-  fs->entries = calloc (1, sizeof (struct pcifs_dirent));
+  fs->entries = alloc_entries (1, 0, &fs->dirs);
   if (!fs->entries)
-    {
-      free (fs->entries);
-      return ENOMEM;
-    }
+    return ENOMEM;
 
   /* Create the root entry */
   err =
     create_dir_entry (-1, -1, -1, -1, -1, "", 0, np->nn_stat, np, 0,
-		      fs->entries);
+		      FILE_KIND_DIR, 0, fs->entries);
+  if (err)
+    return err;
+  fs->entries->cold->ino = 1;
 
   fs->num_entries = 1;
   fs->root = netfs_root_node = np;
   fs->root->nn->ln = fs->entries;
-  pthread_mutex_init (&fs->node_cache_lock, 0);
+  for (i = 0; i < NODE_CACHE_SHARDS; i++)
+    pthread_mutex_init (&fs->node_cache[i].lock, 0);
   pthread_mutex_init (&fs->pci_conf_lock, 0);
 
   return 0;
@@ -137,14 +449,17 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 {
   error_t err = 0;
   int c_domain, c_bus, c_dev, i, j;
-  size_t nentries;
+  size_t nentries, ndirs, size;
   struct pci_device *device;
   struct pcifs_dirent *e, *domain_parent, *bus_parent, *dev_parent,
-    *func_parent, *list;
+    *func_parent, *rom_parent, *list;
+  struct pcifs_dirent_cold *root_cold;
+  struct pcifs_dir *dirs;
   struct stat e_stat;
   char entry_name[NAME_SIZE];
 
   nentries = 1;			/* Skip root entry */
+  ndirs = 1;
   c_domain = c_bus = c_dev = -1;
   for (i = 0, device = pci_sys->devices; i < pci_sys->num_devices;
        i++, device++)
@@ -155,6 +470,7 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	  c_bus = -1;
 	  c_dev = -1;
 	  nentries++;
+	  ndirs++;
 	}
 
       if (device->bus != c_bus)
@@ -162,27 +478,48 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	  c_bus = device->bus;
 	  c_dev = -1;
 	  nentries++;
+	  ndirs++;
 	}
 
       if (device->dev != c_dev)
 	{
 	  c_dev = device->dev;
 	  nentries++;
+	  ndirs++;
 	}
 
-      nentries += 2;		/* func dir + config */
+      nentries += 4;		/* func dir + config + caps + topology */
+      ndirs++;
 
       for (j = 0; j < 6; j++)
-	if (device->regions[j].size > 0)
-	  nentries++;		/* + memory region */
+	{
+	  if (device->regions[j].size > 0)
+	    nentries++;		/* + memory region */
+	  if (device->regions[j].size > 0 && device->regions[j].is_IO)
+	    nentries++;		/* + fifo */
+	}
 
       if (device->rom_size)
-	nentries++;		/* + rom */
+	{
+	  /* + rom + images dir + room for the images */
+	  nentries += 2 + PCI_ROM_MAX_IMAGES;
+	  ndirs++;
+	}
+
+      if (device->msix.table_size)
+	nentries += 2;		/* + msix table + pba */
     }
 
-  list = realloc (fs->entries, nentries * sizeof (struct pcifs_dirent));
+  nentries++;			/* + stats */
+
+  /* The whole tree goes in one block, starting with the root entry */
+  list = alloc_entries (nentries, ndirs, &dirs);
   if (!list)
     return ENOMEM;
+  root_cold = list->cold;
+  *root_cold = *fs->entries->cold;
+  *list = *fs->entries;
+  list->cold = root_cold;
 
   e = list + 1;
   c_domain = c_bus = c_dev = -1;
@@ -193,13 +530,13 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
       if (device->domain != c_domain)
 	{
 	  /* We've found a new domain. Add an entry for it */
-	  e_stat = list->stat;
+	  entry_get_stat (list, &e_stat);
 	  e_stat.st_mode &= ~S_IROOT;	/* Remove the root mode */
 	  memset (entry_name, 0, NAME_SIZE);
 	  snprintf (entry_name, NAME_SIZE, "%04x", device->domain);
 	  err =
-	    create_dir_entry (device->domain, -1, -1, -1, -1, entry_name,
-			      list, e_stat, 0, 0, e);
+	    create_dir_entry (device->domain, -1, -1, -1, -1, entry_name, list,
+			      e_stat, 0, 0, FILE_KIND_DIR, 0, e);
 	  if (err)
 	    return err;
 
@@ -215,10 +552,11 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	  /* We've found a new bus. Add an entry for it */
 	  memset (entry_name, 0, NAME_SIZE);
 	  snprintf (entry_name, NAME_SIZE, "%02x", device->bus);
+	  entry_get_stat (domain_parent, &e_stat);
 	  err =
 	    create_dir_entry (device->domain, device->bus, -1, -1, -1,
-			      entry_name, domain_parent, domain_parent->stat,
-			      0, 0, e);
+			      entry_name, domain_parent, e_stat, 0, 0,
+			      FILE_KIND_DIR, 0, e);
 	  if (err)
 	    return err;
 
@@ -233,10 +571,11 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	  /* We've found a new dev. Add an entry for it */
 	  memset (entry_name, 0, NAME_SIZE);
 	  snprintf (entry_name, NAME_SIZE, "%02x", device->dev);
+	  entry_get_stat (bus_parent, &e_stat);
 	  err =
-	    create_dir_entry (device->domain, device->bus, device->dev, -1,
-			      -1, entry_name, bus_parent, bus_parent->stat, 0,
-			      0, e);
+	    create_dir_entry (device->domain, device->bus, device->dev, -1, -1,
+			      entry_name, bus_parent, e_stat, 0, 0,
+			      FILE_KIND_DIR, 0, e);
 	  if (err)
 	    return err;
 
@@ -246,7 +585,7 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	}
 
       /* Remove all permissions to others */
-      e_stat = dev_parent->stat;
+      entry_get_stat (dev_parent, &e_stat);
       e_stat.st_mode &= ~(S_IROTH | S_IWOTH | S_IXOTH);
 
       /* Add func entry */
@@ -255,7 +594,7 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
       err =
 	create_dir_entry (device->domain, device->bus, device->dev,
 			  device->func, device->device_class, entry_name,
-			  dev_parent, e_stat, 0, device, e);
+			  dev_parent, e_stat, 0, device, FILE_KIND_DIR, 0, e);
       if (err)
 	return err;
 
@@ -263,7 +602,7 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
       func_parent = e++;
 
       /* Change mode to a regular file */
-      e_stat = func_parent->stat;
+      entry_get_stat (func_parent, &e_stat);
       e_stat.st_mode &= ~(S_IFDIR | S_IXUSR | S_IXGRP);
       e_stat.st_mode |= S_IFREG | S_IWUSR | S_IWGRP;
       e_stat.st_size = device->config_size;
@@ -273,9 +612,37 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
       err =
 	create_dir_entry (device->domain, device->bus, device->dev,
 			  device->func, device->device_class, entry_name,
-			  func_parent, e_stat, 0, device, e++);
+			  func_parent, e_stat, 0, device, FILE_KIND_CONFIG, 0,
+			  e++);
+      if (err)
+	return err;
+
+      /* Create the capabilities entry, read only */
+      e_stat.st_mode &= ~(S_IWUSR | S_IWGRP);
+      e_stat.st_size = device->num_caps * sizeof (struct pci_cap);
+      strncpy (entry_name, FILE_CAPS_NAME, NAME_SIZE);
+      err =
+	create_dir_entry (device->domain, device->bus, device->dev,
+			  device->func, device->device_class, entry_name,
+			  func_parent, e_stat, 0, device, FILE_KIND_CAPS, 0,
+			  e++);
+      if (err)
+	return err;
+
+      /* Create the topology entry, read only as well */
+      err = topology_file_size (device, &size);
+      if (err)
+	return err;
+      e_stat.st_size = size;
+      strncpy (entry_name, FILE_TOPOLOGY_NAME, NAME_SIZE);
+      err =
+	create_dir_entry (device->domain, device->bus, device->dev,
+			  device->func, device->device_class, entry_name,
+			  func_parent, e_stat, 0, device, FILE_KIND_TOPOLOGY,
+			  0, e++);
       if (err)
 	return err;
+      e_stat.st_mode |= S_IWUSR | S_IWGRP;
 
       /* Create regions entries */
       for (j = 0; j < 6; j++)
@@ -288,12 +655,56 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 		create_dir_entry (device->domain, device->bus, device->dev,
 				  device->func, device->device_class,
 				  entry_name, func_parent, e_stat, 0, device,
-				  e++);
+				  FILE_KIND_REGION, j, e++);
+	      if (err)
+		return err;
+	    }
+	}
+
+      /* Create FIFO entries for I/O regions */
+      for (j = 0; j < 6; j++)
+	{
+	  if (device->regions[j].size > 0 && device->regions[j].is_IO)
+	    {
+	      e_stat.st_size = device->regions[j].size;
+	      snprintf (entry_name, NAME_SIZE, "%s%01u", FILE_FIFO_NAME, j);
+	      err =
+		create_dir_entry (device->domain, device->bus, device->dev,
+				  device->func, device->device_class,
+				  entry_name, func_parent, e_stat, 0, device,
+				  FILE_KIND_FIFO, j, e++);
 	      if (err)
 		return err;
 	    }
 	}
 
+      /* Create MSI-X entries */
+      if (device->msix.table_size)
+	{
+	  e_stat.st_size = PCI_MSIX_TABLE_BYTES (&device->msix);
+	  strncpy (entry_name, FILE_MSIX_TABLE_NAME, NAME_SIZE);
+	  err =
+	    create_dir_entry (device->domain, device->bus, device->dev,
+			      device->func, device->device_class, entry_name,
+			      func_parent, e_stat, 0, device,
+			      FILE_KIND_MSIX_TABLE, 0, e++);
+	  if (err)
+	    return err;
+
+	  /* The PBA is read only */
+	  e_stat.st_mode &= ~(S_IWUSR | S_IWGRP);
+	  e_stat.st_size = PCI_MSIX_PBA_BYTES (&device->msix);
+	  strncpy (entry_name, FILE_MSIX_PBA_NAME, NAME_SIZE);
+	  err =
+	    create_dir_entry (device->domain, device->bus, device->dev,
+			      device->func, device->device_class, entry_name,
+			      func_parent, e_stat, 0, device,
+			      FILE_KIND_MSIX_PBA, 0, e++);
+	  if (err)
+	    return err;
+	  e_stat.st_mode |= S_IWUSR | S_IWGRP;
+	}
+
       /* Create rom entry */
       if (device->rom_size)
 	{
@@ -304,18 +715,72 @@ create_fs_tree (struct pcifs * fs, struct pci_system * pci_sys)
 	  err =
 	    create_dir_entry (device->domain, device->bus, device->dev,
 			      device->func, device->device_class, entry_name,
-			      func_parent, e_stat, 0, device, e++);
+			      func_parent, e_stat, 0, device, FILE_KIND_ROM, 0,
+			      e++);
+	  if (err)
+	    return err;
+
+	  /*
+	   * And a directory for its images. They are only known once the ROM
+	   * is read, so their entries are filled then.
+	   */
+	  entry_get_stat (func_parent, &e_stat);
+	  e_stat.st_mode &= ~(S_IWUSR | S_IWGRP);
+	  strncpy (entry_name, FILE_ROM_IMAGES_NAME, NAME_SIZE);
+	  err =
+	    create_dir_entry (device->domain, device->bus, device->dev,
+			      device->func, device->device_class, entry_name,
+			      func_parent, e_stat, 0, device,
+			      FILE_KIND_ROM_DIR, 0, e);
 	  if (err)
 	    return err;
+	  rom_parent = e++;
+
+	  e_stat.st_mode &= ~(S_IFDIR | S_IXUSR | S_IXGRP);
+	  e_stat.st_mode |= S_IFREG;
+	  e_stat.st_size = 0;
+	  for (j = 0; j < PCI_ROM_MAX_IMAGES; j++)
+	    {
+	      err =
+		create_dir_entry (device->domain, device->bus, device->dev,
+				  device->func, device->device_class, "",
+				  rom_parent, e_stat, 0, device,
+				  FILE_KIND_ROM_IMAGE, j, e++);
+	      if (err)
+		return err;
+	    }
 	}
     }
 
+  /* Create the stats entry under the root, read only */
+  err = stats_file_size (&size);
+  if (err)
+    return err;
+  entry_get_stat (list, &e_stat);
+  e_stat.st_mode &= ~(S_IFMT | S_IROOT | S_IWUSR | S_IWGRP | S_IWOTH
+		      | S_IXUSR | S_IXGRP | S_IXOTH);
+  e_stat.st_mode |= S_IFREG;
+  e_stat.st_size = size;
+  err =
+    create_dir_entry (-1, -1, -1, -1, -1, FILE_STATS_NAME, list, e_stat, 0, 0,
+		      FILE_KIND_STATS, 0, e++);
+  if (err)
+    return err;
+
   /* The root node points to the first element of the entry list */
+  free (fs->entries);
   fs->entries = list;
   fs->num_entries = nentries;
+  fs->dirs = dirs;
+  fs->num_dirs = ndirs;
   fs->root->nn->ln = fs->entries;
 
-  return err;
+  /* Number the entries, the listings need it */
+  for (i = 0, e = list; i < nentries; i++, e++)
+    e->cold->ino = i + 1;
+
+  /* Index and serialize the directories */
+  return fs_index_dirs (fs);
 }
 
 error_t
@@ -324,31 +789,21 @@ entry_check_perms (struct iouser * user, struct pcifs_dirent * e, int flags)
   error_t err = 0;
 
   if (!err && (flags & O_READ))
-    err = fshelp_access (&e->stat, S_IREAD, user);
+    err = fshelp_access (ENTRY_STAT_TMPL (e), S_IREAD, user);
   if (!err && (flags & O_WRITE))
-    err = fshelp_access (&e->stat, S_IWRITE, user);
+    err = fshelp_access (ENTRY_STAT_TMPL (e), S_IWRITE, user);
   if (!err && (flags & O_EXEC))
-    err = fshelp_access (&e->stat, S_IEXEC, user);
+    err = fshelp_access (ENTRY_STAT_TMPL (e), S_IEXEC, user);
 
   return err;
 }
 
-/* Set default permissions to the given entry */
-static void
-entry_default_perms (struct pcifs *fs, struct pcifs_dirent *e)
-{
-  /* Set default owner and group */
-  UPDATE_OWNER (e, fs->root->nn->ln->stat.st_uid);
-  UPDATE_GROUP (e, fs->root->nn->ln->stat.st_gid);
-
-  /* Update ctime */
-  UPDATE_TIMES (e, TOUCH_CTIME);
-
-  return;
-}
-
+/*
+ * Set the owner and group in `st' to the ones `e' gets from the first
+ * permission scope covering it, if any.
+ */
 static void
-entry_set_perms (struct pcifs *fs, struct pcifs_dirent *e)
+entry_perms (struct pcifs *fs, struct pcifs_dirent *e, io_statbuf_t * st)
 {
   int i;
   struct pcifs_perm *perms = fs->params.perms, *p;
@@ -375,34 +830,73 @@ entry_set_perms (struct pcifs *fs, struct pcifs_dirent *e)
 
       /* This permission set covers this entry */
       if (p->uid >= 0)
-	UPDATE_OWNER (e, p->uid);
+	st->st_uid = p->uid;
       if (p->gid >= 0)
-	UPDATE_GROUP (e, p->gid);
-
-      /* Update ctime */
-      UPDATE_TIMES (e, TOUCH_CTIME);
+	st->st_gid = p->gid;
 
-      /* Break, as only one permission set can cover each node */
+      /* Only one permission set can cover each node */
       break;
     }
-
-  return;
 }
 
-/* Update all entries' permissions */
+/*
+ * Update all entries' permissions. Entries only switch to the stat
+ * template with their new owner and group.
+ */
 error_t
 fs_set_permissions (struct pcifs * fs)
 {
+  error_t err;
   int i;
   struct pcifs_dirent *e;
+  uid_t uid;
+  gid_t gid;
+  io_statbuf_t st;
+
+  /* Default owner and group */
+  uid = ENTRY_STAT_TMPL (fs->entries)->st_uid;
+  gid = ENTRY_STAT_TMPL (fs->entries)->st_gid;
 
   for (i = 0, e = fs->entries; i < fs->num_entries; i++, e++)
     {
-      /* Restore default perms, as this may be called from fsysopts */
-      entry_default_perms (fs, e);
+      st = *ENTRY_STAT_TMPL (e);
+      st.st_uid = uid;
+      st.st_gid = gid;
+      entry_perms (fs, e, &st);
+
+      err = stat_tmpl_get (fs, &st, &e->cold->stat_tmpl);
+      if (err)
+	return err;
+      if (e->node)
+	{
+	  e->node->nn_stat.st_uid = st.st_uid;
+	  e->node->nn_stat.st_gid = st.st_gid;
+	}
+
+      /* Update ctime */
+      UPDATE_TIMES (e, TOUCH_CTIME);
+    }
 
-      /* Set new permissions, if any */
-      entry_set_perms (fs, e);
+  return 0;
+}
+
+/*
+ * Get a node for every entry and keep a reference to it forever, so lookups
+ * never allocate nor go through the node cache.
+ */
+error_t
+fs_pin_nodes (struct pcifs * fs)
+{
+  error_t err;
+  int i;
+  struct node *node;
+  struct pcifs_dirent *e;
+
+  for (i = 0, e = fs->entries; i < fs->num_entries; i++, e++)
+    {
+      err = entry_get_node (e, &node);
+      if (err)
+	return err;
     }
 
   return 0;
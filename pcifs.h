@@ -29,6 +29,7 @@
 
 #include <pci_access.h>
 #include <netfs_impl.h>
+#include <etimes.h>
 
 /* Size of a directory entry name */
 #ifndef NAME_SIZE
@@ -36,7 +37,24 @@
 #endif
 
 /* Node cache defaults size */
-#define NODE_CACHE_MAX 16
+#define NODE_CACHE_MAX 256
+
+/* What a directory entry is, to dispatch operations on it */
+enum pcifs_file_kind
+{
+  FILE_KIND_DIR = 0,
+  FILE_KIND_CONFIG,
+  FILE_KIND_CAPS,
+  FILE_KIND_TOPOLOGY,
+  FILE_KIND_REGION,
+  FILE_KIND_FIFO,
+  FILE_KIND_MSIX_TABLE,
+  FILE_KIND_MSIX_PBA,
+  FILE_KIND_ROM,
+  FILE_KIND_ROM_DIR,
+  FILE_KIND_ROM_IMAGE,
+  FILE_KIND_STATS,
+};
 
 /*
  * Directory entry. Contains all per-node data our problem requires.
@@ -45,6 +63,10 @@
  * fs tree and create or retrieve libnetfs node objects.
  *
  * From libnetfs' point of view, these are the light nodes.
+ *
+ * Only the fields needed to walk the tree and dispatch operations live
+ * here. The name and the stat buffer are in a separate array, see
+ * `struct pcifs_dirent_cold'.
  */
 struct pcifs_dirent
 {
@@ -60,6 +82,20 @@ struct pcifs_dirent
   int16_t dev;
   int8_t func;
 
+  /*
+   * One of FILE_KIND_*, and the region or ROM image number for the kinds
+   * which have one.
+   */
+  uint8_t kind;
+  uint8_t index;
+
+  /*
+   * Node cache state: the list the entry is in, its position there and its
+   * reference bit. Entries stay in the ghost lists once their node is gone.
+   */
+  uint8_t ncache_list;
+  uint8_t ncache_ref;
+
   /*
    * Device's class, subclass, and programming interface packed into a
    * single 32-bit value.  The class is at bits [23:16], subclass is at
@@ -69,9 +105,9 @@ struct pcifs_dirent
    */
   int32_t device_class;
 
-  char name[NAME_SIZE];
+  uint32_t name_hash;
+
   struct pcifs_dirent *parent;
-  io_statbuf_t stat;
 
   /*
    * We only need two kind of nodes: files and directories.
@@ -82,16 +118,45 @@ struct pcifs_dirent
   /* Active node on this entry */
   struct node *node;
 
+  struct pcifs_dirent *ncache_next, *ncache_prev;
+
   /*
    * Underlying virtual device if any.
    *
    * Only for entries having a full B/D/F address.
    */
   struct pci_device *device;
+
+  /* Rarely used data */
+  struct pcifs_dirent_cold *cold;
+};
+
+/*
+ * Directory entry data only needed for stat, permission checks and
+ * building the tree.
+ *
+ * Entries share their stat buffer with all others having the same mode,
+ * owner and group, see `stat_tmpls' in `struct pcifs'. They only keep what
+ * differs. Templates are never moved nor freed, so the pointer stays valid
+ * while fsysopts switches the entry to another one.
+ */
+struct pcifs_dirent_cold
+{
+  char name[NAME_SIZE];
+  io_statbuf_t *stat_tmpl;
+  ino_t ino;
+  off_t size;
+  struct timespec atime;
+  struct timespec mtime;
+  struct timespec ctime;
 };
 
 /*
- * A directory, it only contains a list of directory entries
+ * A directory.
+ *
+ * The tree is laid out in compressed sparse row form: the entries of each
+ * directory are a slice of one array, and so are the hash table, the
+ * listing and the offsets below.
  */
 struct pcifs_dir
 {
@@ -100,6 +165,26 @@ struct pcifs_dir
 
   /* Array of directory entries */
   struct pcifs_dirent **entries;
+
+  /*
+   * Open addressing hash table on the entry names. Slots hold an index in
+   * `entries' plus one, zero for empty slots. `hash_size' is a power of two.
+   */
+  uint16_t *hash;
+  uint32_t hash_size;
+
+  /*
+   * The listing, as returned by netfs_get_dirents, and the offset of each
+   * entry in it. `dirent_offs' has one more element holding the total size.
+   */
+  char *dirents;
+  uint32_t *dirent_offs;
+
+  /*
+   * The ROM images directory is empty until the ROM is first read, its
+   * entries are reserved at startup and shown then. See rom_images_load.
+   */
+  uint8_t filled;
 };
 
 /*
@@ -132,12 +217,55 @@ struct pcifs_perm
   int32_t gid;
 };
 
+/* Number of independent node cache shards */
+#define NODE_CACHE_SHARDS 8
+
+/* Initial length of each shard, it grows up to its share of the maximum */
+#define NODE_CACHE_SHARD_INIT 2
+
+/* A list of entries in the node cache, oldest first */
+struct pcifs_ncache_list
+{
+  struct pcifs_dirent *head, *tail;
+  size_t len;
+};
+
+/*
+ * A shard of the node cache.
+ *
+ * `t1' holds the entries seen once recently, `t2' the ones seen at least
+ * twice. Both hold a reference to their node. `b1' and `b2' remember the
+ * entries recently evicted from each, without their nodes. `p' is the
+ * target length of `t1' and `size' the length of the shard.
+ */
+struct pcifs_ncache_shard
+{
+  pthread_mutex_t lock;
+  struct pcifs_ncache_list t1, t2, b1, b2;
+  size_t p;
+  size_t size;
+
+  /* Statistics */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
 /* Various parameters that can be used to change the behavior of an ftpfs.  */
 struct pcifs_params
 {
   /* The size of the node cache.  */
   size_t node_cache_max;
 
+  /* Whether all nodes are created upfront and never released.  */
+  int pin_nodes;
+
+  /*
+   * Seconds between access time updates of an entry. Zero to update all
+   * times right away.
+   */
+  unsigned int relatime;
+
   /* FS permissions.  */
   struct pcifs_perm *perms;
   size_t num_perms;
@@ -153,15 +281,29 @@ struct pcifs
   struct pcifs_params params;
 
   /* A cache that holds a reference to recently used nodes.  */
-  struct node *node_cache_mru, *node_cache_lru;
-  size_t node_cache_len;	/* Number of entries in it.  */
-  pthread_mutex_t node_cache_lock;
+  struct pcifs_ncache_shard node_cache[NODE_CACHE_SHARDS];
 
   /* Lock for pci_conf operations */
   pthread_mutex_t pci_conf_lock;
 
+  /*
+   * All entries, followed in the same allocation by their cold data and
+   * the directories.
+   */
   struct pcifs_dirent *entries;
   size_t num_entries;
+  struct pcifs_dir *dirs;
+  size_t num_dirs;
+
+  /*
+   * Entries of all directories, followed in the same allocation by their
+   * hash tables and listings.
+   */
+  struct pcifs_dirent **children;
+
+  /* Stat buffers shared by the entries, allocated one by one */
+  io_statbuf_t **stat_tmpls;
+  size_t num_stat_tmpls;
 };
 
 /* Main FS pointer */
@@ -170,30 +312,29 @@ struct pcifs *fs;
 /* Global mapped time */
 volatile struct mapped_time_value *pcifs_maptime;
 
+/* Stat template of an entry, for its mode, owner and group */
+#define ENTRY_STAT_TMPL(e) ((e)->cold->stat_tmpl)
+
 /* Update entry and node times */
 #define UPDATE_TIMES(e, what) (\
   {\
-    fshelp_touch (&e->stat, what, pcifs_maptime);\
-    if(e->node)\
-      fshelp_touch (&e->node->nn_stat, what, pcifs_maptime);\
-  }\
-)
-
-/* Update entry and node owner */
-#define UPDATE_OWNER(e, uid) (\
-  {\
-    e->stat.st_uid = uid;\
-    if(e->node)\
-      e->node->nn_stat.st_uid = uid;\
+    if (fs->params.relatime)\
+      etimes_touch (e, what);\
+    else\
+      {\
+	entry_touch (e, what);\
+	if(e->node)\
+	  fshelp_touch (&e->node->nn_stat, what, pcifs_maptime);\
+      }\
   }\
 )
 
-/* Update entry and node group */
-#define UPDATE_GROUP(e, gid) (\
+/* Update entry and node size */
+#define UPDATE_SIZE(e, new_size) (\
   {\
-    e->stat.st_gid = gid;\
+    e->cold->size = new_size;\
     if(e->node)\
-      e->node->nn_stat.st_gid = gid;\
+      e->node->nn_stat.st_size = new_size;\
   }\
 )
 
@@ -202,7 +343,14 @@ error_t alloc_file_system (struct pcifs **fs);
 error_t init_file_system (file_t underlying_node, struct pcifs *fs);
 error_t create_fs_tree (struct pcifs *fs, struct pci_system *pci_sys);
 error_t fs_set_permissions (struct pcifs *fs);
+error_t fs_pin_nodes (struct pcifs *fs);
+uint32_t pcifs_name_hash (const char *name);
+struct pcifs_dirent *pcifs_dir_lookup (struct pcifs_dir *dir,
+				       const char *name);
+void pcifs_dir_fill (struct pcifs_dir *dir, size_t n);
 error_t entry_check_perms (struct iouser *user, struct pcifs_dirent *e,
 			   int flags);
+void entry_get_stat (struct pcifs_dirent *e, io_statbuf_t * st);
+void entry_touch (struct pcifs_dirent *e, int what);
 
 #endif /* PCIFS_H */
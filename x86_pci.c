@@ -37,11 +37,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/io.h>
 #include <string.h>
 
 #include <pci_access.h>
+#include <pci_map.h>
+#include <mmio.h>
 
 #define PCI_VENDOR(reg)		((reg) & 0xFFFF)
 #define PCI_VENDOR_INVALID	0xFFFF
@@ -55,17 +56,13 @@
 #define PCI_CLASS_DISPLAY_VGA	0x0300
 #define PCI_CLASS_BRIDGE_HOST	0x0600
 
-#define PCI_BAR_ADDR_0		0x10
-#define PCI_XROMBAR_ADDR_00	0x30
-#define PCI_XROMBAR_ADDR_01	0x38
-
 #define PCI_HDRTYPE		0x0E
 #define PCI_HDRTYPE_DEVICE	0x00
 #define PCI_HDRTYPE_BRIDGE	0x01
 #define PCI_HDRTYPE_CARDBUS	0x02
 
-#define PCI_COMMAND		0x04
 #define PCI_SECONDARY_BUS	0x19
+#define PCI_SUBORDINATE_BUS	0x1A
 
 #define PCI_CONFIG_SIZE  256
 
@@ -308,17 +305,23 @@ get_map_base (uint32_t val)
     return val & ~0x0f;
 }
 
-/* Returns the size of a region based on the all-ones test value */
-static unsigned
-get_test_val_size (uint32_t testval)
+/*
+ * Returns the size of a region based on the all-ones test value.
+ *
+ * For 64-bit BARs, the upper dword of `testval' must contain the value read
+ * back from the upper BAR, otherwise it must be zero.
+ */
+static pciaddr_t
+get_test_val_size (pciaddr_t testval)
 {
-  unsigned size = 1;
+  pciaddr_t size = 1;
 
   if (testval == 0)
     return 0;
 
-  /* Mask out the flag bits */
-  testval = get_map_base (testval);
+  /* Mask out the flag bits, they are all in the lower dword */
+  testval = (testval & ~(pciaddr_t) 0xFFFFFFFF)
+    | get_map_base ((uint32_t) testval);
   if (!testval)
     return 0;
 
@@ -331,63 +334,80 @@ get_test_val_size (uint32_t testval)
   return size;
 }
 
-/* Read BAR `reg_num' in `dev' and map the data if any */
+/* Test write all ones to the register at `offset', then restore it. */
 static error_t
-pci_device_x86_region_probe (struct pci_device *dev, int reg_num)
+pci_device_x86_bar_test (struct pci_device *dev, uint8_t offset,
+			 uint32_t * addr, uint32_t * testval)
 {
   error_t err;
-  uint8_t offset;
-  uint32_t reg, addr, testval;
-  int memfd;
-
-  offset = PCI_BAR_ADDR_0 + 0x4 * reg_num;
+  uint32_t reg;
 
-  /* Get the base address */
   err =
-    pci_sys->read (dev->bus, dev->dev, dev->func, offset, &addr,
-		   sizeof (addr));
+    pci_sys->read (dev->bus, dev->dev, dev->func, offset, addr,
+		   sizeof (*addr));
   if (err)
     return err;
 
-  /* Test write all ones to the register, then restore it. */
   reg = 0xffffffff;
   err = pci_sys->write (dev->bus, dev->dev, dev->func, offset, &reg,
 			sizeof (reg));
   if (err)
     return err;
-  err = pci_sys->read (dev->bus, dev->dev, dev->func, offset, &testval,
-		       sizeof (testval));
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, offset, testval,
+		       sizeof (*testval));
   if (err)
     return err;
-  err = pci_sys->write (dev->bus, dev->dev, dev->func, offset, &addr,
-			sizeof (addr));
+
+  return pci_sys->write (dev->bus, dev->dev, dev->func, offset, addr,
+			 sizeof (*addr));
+}
+
+/* Read BAR `reg_num' in `dev' and enable its decoder if any */
+static error_t
+pci_device_x86_region_probe (struct pci_device *dev, int reg_num)
+{
+  error_t err;
+  uint8_t offset;
+  uint32_t reg, addr, testval, addr_hi, testval_hi;
+
+  offset = PCI_BAR_ADDR_0 + 0x4 * reg_num;
+
+  /* This may be a refresh, start from scratch */
+  memset (&dev->regions[reg_num], 0, sizeof (struct pci_mem_region));
+
+  /* Get the base address and the all-ones test value */
+  err = pci_device_x86_bar_test (dev, offset, &addr, &testval);
   if (err)
     return err;
 
+  /* Flag bits other than the I/O one are only defined for memory BARs */
   if (addr & 0x01)
     dev->regions[reg_num].is_IO = 1;
-  if (addr & 0x04)
-    dev->regions[reg_num].is_64 = 1;
-  if (addr & 0x08)
-    dev->regions[reg_num].is_prefetchable = 1;
-
-  /* Set the size */
-  dev->regions[reg_num].size = get_test_val_size (testval);
-
-  /* Set the base address value */
-  dev->regions[reg_num].base_addr = get_map_base (addr);
+  else
+    {
+      if ((addr & 0x06) == 0x04)
+	dev->regions[reg_num].is_64 = 1;
+      if (addr & 0x08)
+	dev->regions[reg_num].is_prefetchable = 1;
+    }
 
+  /* The upper BAR of a 64-bit region must be sized as well */
+  addr_hi = testval_hi = 0;
   if (dev->regions[reg_num].is_64)
     {
-      err =
-	pci_sys->read (dev->bus, dev->dev, dev->func, offset + 4, &addr,
-		       sizeof (addr));
+      err = pci_device_x86_bar_test (dev, offset + 4, &addr_hi, &testval_hi);
       if (err)
 	return err;
-
-      dev->regions[reg_num].base_addr |= ((uint64_t) addr << 32);
     }
 
+  /* Set the size */
+  dev->regions[reg_num].size =
+    get_test_val_size (((pciaddr_t) testval_hi << 32) | testval);
+
+  /* Set the base address value */
+  dev->regions[reg_num].base_addr =
+    ((pciaddr_t) addr_hi << 32) | get_map_base (addr);
+
   if (dev->regions[reg_num].is_IO)
     {
       /* Enable the I/O Space bit */
@@ -407,9 +427,6 @@ pci_device_x86_region_probe (struct pci_device *dev, int reg_num)
 	  if (err)
 	    return err;
 	}
-
-      /* Clear the map pointer */
-      dev->regions[reg_num].memory = 0;
     }
   else if (dev->regions[reg_num].size > 0)
     {
@@ -430,59 +447,55 @@ pci_device_x86_region_probe (struct pci_device *dev, int reg_num)
 	  if (err)
 	    return err;
 	}
-
-      /* Map the region in our space */
-      memfd = open ("/dev/mem", O_RDONLY | O_CLOEXEC);
-      if (memfd == -1)
-	return errno;
-
-      dev->regions[reg_num].memory =
-	mmap (NULL, dev->regions[reg_num].size, PROT_READ | PROT_WRITE, 0,
-	      memfd, dev->regions[reg_num].base_addr);
-      if (dev->regions[reg_num].memory == MAP_FAILED)
-	{
-	  dev->regions[reg_num].memory = 0;
-	  close (memfd);
-	  return errno;
-	}
-
-      close (memfd);
     }
 
   return 0;
 }
 
-/* Read the XROMBAR in `dev' and map the data if any */
+/* Get the offset of the ROM BAR of `dev', which depends on the header type */
 static error_t
-pci_device_x86_rom_probe (struct pci_device *dev)
+pci_device_x86_xrombar_addr (struct pci_device *dev, uint8_t * addr)
 {
   error_t err;
-  uint8_t reg_8, xrombar_addr;
-  uint32_t reg, reg_back;
-  pciaddr_t rom_size;
-  pciaddr_t rom_base;
-  void *rom_mapped;
-  int memfd;
+  uint8_t hdrtype;
 
-  /* First we need to know which type of header is this */
-  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_HDRTYPE, &reg_8,
-		       sizeof (reg_8));
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_HDRTYPE, &hdrtype,
+		       sizeof (hdrtype));
   if (err)
     return err;
 
-  /* Get the XROMBAR register address */
-  switch (reg_8 & 0x3)
+  switch (hdrtype & 0x3)
     {
     case PCI_HDRTYPE_DEVICE:
-      xrombar_addr = PCI_XROMBAR_ADDR_00;
+      *addr = PCI_XROMBAR_ADDR_00;
       break;
     case PCI_HDRTYPE_BRIDGE:
-      xrombar_addr = PCI_XROMBAR_ADDR_01;
+      *addr = PCI_XROMBAR_ADDR_01;
       break;
     default:
       return -1;
     }
 
+  return 0;
+}
+
+/*
+ * Read the ROM BAR of `dev'. The BAR is restored afterwards, so the ROM
+ * decoder is left as we found it.
+ */
+static error_t
+pci_device_x86_rom_probe (struct pci_device *dev)
+{
+  error_t err;
+  uint8_t xrombar_addr;
+  uint32_t reg, reg_back;
+  pciaddr_t rom_size;
+  pciaddr_t rom_base;
+
+  err = pci_device_x86_xrombar_addr (dev, &xrombar_addr);
+  if (err)
+    return err;
+
   /* Get size and physical address */
   err = pci_sys->read (dev->bus, dev->dev, dev->func, xrombar_addr, &reg,
 		       sizeof (reg));
@@ -500,56 +513,113 @@ pci_device_x86_rom_probe (struct pci_device *dev)
   if (err)
     return err;
 
+  /* Write the physical address back */
+  err = pci_sys->write
+    (dev->bus, dev->dev, dev->func, xrombar_addr, &reg_back,
+     sizeof (reg_back));
+  if (err)
+    return err;
+
   rom_size = (~reg + 1);
   rom_base = reg_back & reg;
 
   if (rom_size == 0)
     return 0;
 
-  /* Enable the address decoder and write the physical address back */
-  reg_back |= 0x1;
-  err = pci_sys->write
-    (dev->bus, dev->dev, dev->func, xrombar_addr, &reg_back,
-     sizeof (reg_back));
+  dev->rom_size = rom_size;
+  dev->rom_base = rom_base;
+
+  return 0;
+}
+
+/*
+ * Read `len' bytes at `offset' from the ROM of `dev'.
+ *
+ * The ROM decoder and memory decoding are enabled just for the copy, and
+ * both registers restored afterwards.
+ */
+static error_t
+pci_device_x86_read_rom (struct pci_device *dev, pciaddr_t offset,
+			 size_t len, void *data)
+{
+  error_t err, err2;
+  uint8_t xrombar_addr;
+  uint32_t reg, reg_back;
+  uint16_t cmd, cmd_back;
+  struct pci_map_window *win;
+  void *addr;
+  size_t avail;
+
+  if (!dev->rom_base)
+    /* The firmware didn't assign an address to the ROM */
+    return EIO;
+
+  if (offset > dev->rom_size || len > dev->rom_size - offset)
+    return EINVAL;
+
+  err = pci_device_x86_xrombar_addr (dev, &xrombar_addr);
   if (err)
     return err;
 
-  /* Enable the Memory Space bit */
-  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_COMMAND, &reg,
-		       sizeof (reg));
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, xrombar_addr,
+		       &reg_back, sizeof (reg_back));
+  if (err)
+    return err;
+  err = pci_sys->read (dev->bus, dev->dev, dev->func, PCI_COMMAND,
+		       &cmd_back, sizeof (cmd_back));
   if (err)
     return err;
 
-  if (!(reg & 0x2))
-    {
-      reg |= 0x2;
-
-      err =
-	pci_sys->write (dev->bus, dev->dev, dev->func, PCI_COMMAND, &reg,
+  /* Enable the address decoder */
+  reg = reg_back | 0x1;
+  err = pci_sys->write (dev->bus, dev->dev, dev->func, xrombar_addr, &reg,
 			sizeof (reg));
+  if (err)
+    return err;
+
+  /* Enable the Memory Space bit */
+  cmd = cmd_back | 0x2;
+  if (cmd != cmd_back)
+    {
+      err = pci_sys->write (dev->bus, dev->dev, dev->func, PCI_COMMAND,
+			    &cmd, sizeof (cmd));
       if (err)
-	return err;
+	goto restore_rom;
     }
 
-  /* Map the ROM in our space */
-  memfd = open ("/dev/mem", O_RDONLY | O_CLOEXEC);
-  if (memfd == -1)
-    return errno;
-
-  rom_mapped = mmap (NULL, rom_size, PROT_READ, 0, memfd, rom_base);
-  if (rom_mapped == MAP_FAILED)
+  while (len > 0)
     {
-      close (memfd);
-      return errno;
+      err = pci_map_acquire (dev->rom_base, dev->rom_size, offset, &addr,
+			     &avail, &win);
+      if (err)
+	break;
+
+      if (avail > len)
+	avail = len;
+      mmio_read (data, addr, avail, 1);
+
+      pci_map_release (win);
+
+      offset += avail;
+      data += avail;
+      len -= avail;
     }
 
-  close (memfd);
+  if (cmd != cmd_back)
+    {
+      err2 = pci_sys->write (dev->bus, dev->dev, dev->func, PCI_COMMAND,
+			     &cmd_back, sizeof (cmd_back));
+      if (!err)
+	err = err2;
+    }
 
-  dev->rom_size = rom_size;
-  dev->rom_base = rom_base;
-  dev->rom_memory = rom_mapped;
+restore_rom:
+  err2 = pci_sys->write (dev->bus, dev->dev, dev->func, xrombar_addr,
+			 &reg_back, sizeof (reg_back));
+  if (!err)
+    err = err2;
 
-  return 0;
+  return err;
 }
 
 /* Configure BARs and ROM */
@@ -586,15 +656,18 @@ pci_device_x86_probe (struct pci_device *dev)
 }
 
 /*
- * Refresh the device. Check for updates in region `reg_num'
- * or in ROM if `rom' = true. `reg_num' < 0 means no region check.
+ * Refresh the device. Re-read the base address of region `reg_num'
+ * or of the ROM if `rom' = true. `reg_num' < 0 means no region check.
+ *
+ * Sizes are fixed by the hardware, so the BARs are only read, never probed
+ * again, and the decoders are left alone.
  */
 static error_t
 pci_device_x86_refresh (struct pci_device *dev, int reg_num, int rom)
 {
   error_t err;
-  uint8_t offset, hdrtype;
-  uint32_t addr;
+  uint8_t offset;
+  uint32_t addr, addr_hi = 0;
 
   if (reg_num >= 0 && dev->regions[reg_num].size > 0)
     {
@@ -606,48 +679,33 @@ pci_device_x86_refresh (struct pci_device *dev, int reg_num, int rom)
       if (err)
 	return err;
 
-      /* Check whether the region is outdated, if so, the refresh it */
-      if (dev->regions[reg_num].base_addr != get_map_base (addr))
+      /* And the upper half too, if any */
+      if (dev->regions[reg_num].is_64)
 	{
-	  err = pci_device_x86_region_probe (dev, reg_num);
+	  err =
+	    pci_sys->read (dev->bus, dev->dev, dev->func, offset + 4,
+			   &addr_hi, sizeof (addr_hi));
 	  if (err)
 	    return err;
 	}
+
+      dev->regions[reg_num].base_addr =
+	((pciaddr_t) addr_hi << 32) | get_map_base (addr);
     }
 
   if (rom && dev->rom_size > 0)
     {
       /* Read the BAR */
-      err =
-	pci_sys->read (dev->bus, dev->dev, dev->func, PCI_HDRTYPE, &hdrtype,
-		       sizeof (hdrtype));
+      err = pci_device_x86_xrombar_addr (dev, &offset);
       if (err)
 	return err;
 
-      switch (hdrtype & 0x3)
-	{
-	case PCI_HDRTYPE_DEVICE:
-	  offset = PCI_XROMBAR_ADDR_00;
-	  break;
-	case PCI_HDRTYPE_BRIDGE:
-	  offset = PCI_XROMBAR_ADDR_01;
-	  break;
-	default:
-	  return -1;
-	}
-
       err = pci_sys->read (dev->bus, dev->dev, dev->func, offset, &addr,
 			   sizeof (addr));
       if (err)
 	return err;
 
-      /* Check whether the ROM is outdated, if so, the refresh it */
-      if (dev->rom_base != (addr & 0xFFFFF800))
-	{
-	  err = pci_device_x86_rom_probe (dev);
-	  if (err)
-	    return err;
-	}
+      dev->rom_base = addr & 0xFFFFF800;
     }
 
   return 0;
@@ -716,12 +774,16 @@ pci_nfuncs (struct pci_system *pci_sys, int bus, int dev, uint8_t * nfuncs)
   return 0;
 }
 
-/* Recursively scan bus number `bus' */
+/*
+ * Recursively scan bus number `bus'. `upstream' is the index of the bridge
+ * leading to it, negative for the root bus.
+ */
 static error_t
-pci_system_x86_scan_bus (struct pci_system *pci_sys, uint8_t bus)
+pci_system_x86_scan_bus (struct pci_system *pci_sys, uint8_t bus,
+			 int32_t upstream)
 {
   error_t err;
-  uint8_t dev, func, nfuncs, hdrtype, secbus;
+  uint8_t dev, func, nfuncs, hdrtype, secbus, subbus;
   uint32_t reg;
   struct pci_device *d, *devices;
 
@@ -769,11 +831,24 @@ pci_system_x86_scan_bus (struct pci_system *pci_sys, uint8_t bus)
 	  d->func = func;
 
 	  d->device_class = reg >> 8;
+	  d->upstream = upstream;
 
 	  err = pci_device_x86_probe (d);
 	  if (err)
 	    return err;
 
+	  err = pci_device_parse_caps (d);
+	  if (err)
+	    return err;
+
+	  err = pci_device_parse_msix (d);
+	  if (err)
+	    return err;
+
+	  err = pci_device_parse_link (d);
+	  if (err)
+	    return err;
+
 	  pci_sys->devices = devices;
 	  pci_sys->num_devices++;
 
@@ -790,7 +865,24 @@ pci_system_x86_scan_bus (struct pci_system *pci_sys, uint8_t bus)
 		if (err)
 		  return err;
 
-		err = pci_system_x86_scan_bus (pci_sys, secbus);
+		err =
+		  pci_sys->read (bus, dev, func, PCI_SUBORDINATE_BUS, &subbus,
+				 sizeof (subbus));
+		if (err)
+		  return err;
+
+		d->secondary_bus = secbus;
+		d->subordinate_bus = subbus;
+
+		if ((hdrtype & 0x3) == PCI_HDRTYPE_BRIDGE)
+		  {
+		    err = pci_device_parse_windows (d);
+		    if (err)
+		      return err;
+		  }
+
+		err = pci_system_x86_scan_bus (pci_sys, secbus,
+					       pci_sys->num_devices - 1);
 		if (err)
 		  return err;
 
@@ -831,10 +923,11 @@ pci_system_x86_create (void)
       return err;
     }
   pci_sys->device_refresh = pci_device_x86_refresh;
+  pci_sys->device_read_rom = pci_device_x86_read_rom;
 
   /* Recursive scan */
   pci_sys->num_devices = 0;
-  err = pci_system_x86_scan_bus (pci_sys, 0);
+  err = pci_system_x86_scan_bus (pci_sys, 0, -1);
   if (err)
     {
       x86_disable_io ();